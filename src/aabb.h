@@ -13,6 +13,9 @@ public:
 
     bool hit(const ray& r, double t_min, double t_max) const;
 
+    // Narrows [t_min, t_max] to the part of the ray inside the box.
+    bool clip(const ray& r, double& t_min, double& t_max) const;
+
     point3 minimum;
     point3 maximum;
 };
@@ -32,6 +35,21 @@ inline bool aabb::hit(const ray& r, double t_min, double t_max) const {
     return true;
 }
 
+inline bool aabb::clip(const ray& r, double& t_min, double& t_max) const {
+    for (int a = 0; a < 3; a++) {
+        auto invD = 1.0 / r.direction()[a];
+        auto t0 = (min()[a] - r.origin()[a]) * invD;
+        auto t1 = (max()[a] - r.origin()[a]) * invD;
+        if (invD < 0.0)
+            std::swap(t0, t1);
+        t_min = t0 > t_min ? t0 : t_min;
+        t_max = t1 < t_max ? t1 : t_max;
+        if (t_max <= t_min)
+            return false;
+    }
+    return true;
+}
+
 aabb surrounding_box(aabb box0, aabb box1) {
     point3 small(fmin(box0.min().x(), box1.min().x()),
         fmin(box0.min().y(), box1.min().y()),
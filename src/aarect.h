@@ -14,6 +14,7 @@ public:
         : x0(_x0), x1(_x1), y0(_y0), y1(_y1), k(_k), mp(mat) {};
 
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual void compute_surface_interaction(const ray& r, hit_record& rec) const override;
 
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
         // The bounding box must have non-zero width in each dimension, so pad the Z
@@ -22,6 +23,39 @@ public:
         return true;
     }
 
+    virtual double pdf_value(const point3& origin, const vec3& v) const override {
+        // Plane test only; the normal is +-Z, so the cosine is just the Z component.
+        auto t = (k - origin.z()) / v.z();
+        if (t < 0.001 || t == infinity)
+            return 0;
+        auto x = origin.x() + t * v.x();
+        auto y = origin.y() + t * v.y();
+        if (x < x0 || x > x1 || y < y0 || y > y1)
+            return 0;
+
+        auto area = (x1 - x0) * (y1 - y0);
+        auto distance_squared = t * t * v.length_squared();
+        auto cosine = fabs(v.z() / v.length());
+
+        return distance_squared / (cosine * area);
+    }
+
+    virtual vec3 random(const point3& origin) const override {
+        double u1, u2;
+        random_double2(u1, u2);
+        auto random_point = point3(x0 + u1 * (x1 - x0), y0 + u2 * (y1 - y0), k);
+        return random_point - origin;
+    }
+
+    virtual double surface_area() const override {
+        return (x1 - x0) * (y1 - y0);
+    }
+
+    virtual void find_lights(
+        const shared_ptr<hittable>& self, bool flipped, std::vector<light_candidate>& out) const override {
+        out.push_back({ self, mp.get(), flipped ? -vec3(0, 0, 1) : vec3(0, 0, 1), 1 });
+    }
+
 public:
     shared_ptr<material> mp;
     double x0, x1, y0, y1, k;
@@ -35,14 +69,17 @@ bool xy_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     auto y = r.origin().y() + t * r.direction().y();
     if (x < x0 || x > x1 || y < y0 || y > y1)
         return false;
-    rec.u = (x - x0) / (x1 - x0);
-    rec.v = (y - y0) / (y1 - y0);
-    rec.t = t;
+    rec.set_deferred(this, t);
+    return true;
+}
+
+void xy_rect::compute_surface_interaction(const ray& r, hit_record& rec) const {
+    rec.p = r.at(rec.t);
+    rec.u = (rec.p.x() - x0) / (x1 - x0);
+    rec.v = (rec.p.y() - y0) / (y1 - y0);
     auto outward_normal = vec3(0, 0, 1);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
-    rec.p = r.at(t);
-    return true;
+    rec.mat_ptr = mp.get();
 }
 
 class xz_rect : public hittable {
@@ -54,6 +91,7 @@ public:
         : x0(_x0), x1(_x1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
 
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual void compute_surface_interaction(const ray& r, hit_record& rec) const override;
 
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
         // The bounding box must have non-zero width in each dimension, so pad the Y
@@ -63,22 +101,38 @@ public:
     }
 
     virtual double pdf_value(const point3& origin, const vec3& v) const override {
-        hit_record rec;
-        if (!this->hit(ray(origin, v), 0.001, infinity, rec))
+        // Plane test only; the normal is +-Y, so the cosine is just the Y component.
+        auto t = (k - origin.y()) / v.y();
+        if (t < 0.001 || t == infinity)
+            return 0;
+        auto x = origin.x() + t * v.x();
+        auto z = origin.z() + t * v.z();
+        if (x < x0 || x > x1 || z < z0 || z > z1)
             return 0;
 
         auto area = (x1 - x0) * (z1 - z0);
-        auto distance_squared = rec.t * rec.t * v.length_squared();
-        auto cosine = fabs(dot(v, rec.normal) / v.length());
+        auto distance_squared = t * t * v.length_squared();
+        auto cosine = fabs(v.y() / v.length());
 
         return distance_squared / (cosine * area);
     }
 
     virtual vec3 random(const point3& origin) const override {
-        auto random_point = point3(random_double(x0, x1), k, random_double(z0, z1));
+        double u1, u2;
+        random_double2(u1, u2);
+        auto random_point = point3(x0 + u1 * (x1 - x0), k, z0 + u2 * (z1 - z0));
         return random_point - origin;
     }
 
+    virtual double surface_area() const override {
+        return (x1 - x0) * (z1 - z0);
+    }
+
+    virtual void find_lights(
+        const shared_ptr<hittable>& self, bool flipped, std::vector<light_candidate>& out) const override {
+        out.push_back({ self, mp.get(), flipped ? -vec3(0, 1, 0) : vec3(0, 1, 0), 1 });
+    }
+
 public:
     shared_ptr<material> mp;
     double x0, x1, z0, z1, k;
@@ -93,6 +147,7 @@ public:
         : y0(_y0), y1(_y1), z0(_z0), z1(_z1), k(_k), mp(mat) {};
 
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual void compute_surface_interaction(const ray& r, hit_record& rec) const override;
 
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
         // The bounding box must have non-zero width in each dimension, so pad the X
@@ -101,6 +156,39 @@ public:
         return true;
     }
 
+    virtual double pdf_value(const point3& origin, const vec3& v) const override {
+        // Plane test only; the normal is +-X, so the cosine is just the X component.
+        auto t = (k - origin.x()) / v.x();
+        if (t < 0.001 || t == infinity)
+            return 0;
+        auto y = origin.y() + t * v.y();
+        auto z = origin.z() + t * v.z();
+        if (y < y0 || y > y1 || z < z0 || z > z1)
+            return 0;
+
+        auto area = (y1 - y0) * (z1 - z0);
+        auto distance_squared = t * t * v.length_squared();
+        auto cosine = fabs(v.x() / v.length());
+
+        return distance_squared / (cosine * area);
+    }
+
+    virtual vec3 random(const point3& origin) const override {
+        double u1, u2;
+        random_double2(u1, u2);
+        auto random_point = point3(k, y0 + u1 * (y1 - y0), z0 + u2 * (z1 - z0));
+        return random_point - origin;
+    }
+
+    virtual double surface_area() const override {
+        return (y1 - y0) * (z1 - z0);
+    }
+
+    virtual void find_lights(
+        const shared_ptr<hittable>& self, bool flipped, std::vector<light_candidate>& out) const override {
+        out.push_back({ self, mp.get(), flipped ? -vec3(1, 0, 0) : vec3(1, 0, 0), 1 });
+    }
+
 public:
     shared_ptr<material> mp;
     double y0, y1, z0, z1, k;
@@ -114,14 +202,17 @@ bool xz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     auto z = r.origin().z() + t * r.direction().z();
     if (x < x0 || x > x1 || z < z0 || z > z1)
         return false;
-    rec.u = (x - x0) / (x1 - x0);
-    rec.v = (z - z0) / (z1 - z0);
-    rec.t = t;
+    rec.set_deferred(this, t);
+    return true;
+}
+
+void xz_rect::compute_surface_interaction(const ray& r, hit_record& rec) const {
+    rec.p = r.at(rec.t);
+    rec.u = (rec.p.x() - x0) / (x1 - x0);
+    rec.v = (rec.p.z() - z0) / (z1 - z0);
     auto outward_normal = vec3(0, 1, 0);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
-    rec.p = r.at(t);
-    return true;
+    rec.mat_ptr = mp.get();
 }
 
 bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
@@ -132,14 +223,17 @@ bool yz_rect::hit(const ray& r, double t_min, double t_max, hit_record& rec) con
     auto z = r.origin().z() + t * r.direction().z();
     if (y < y0 || y > y1 || z < z0 || z > z1)
         return false;
-    rec.u = (y - y0) / (y1 - y0);
-    rec.v = (z - z0) / (z1 - z0);
-    rec.t = t;
+    rec.set_deferred(this, t);
+    return true;
+}
+
+void yz_rect::compute_surface_interaction(const ray& r, hit_record& rec) const {
+    rec.p = r.at(rec.t);
+    rec.u = (rec.p.y() - y0) / (y1 - y0);
+    rec.v = (rec.p.z() - z0) / (z1 - z0);
     auto outward_normal = vec3(1, 0, 0);
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mp;
-    rec.p = r.at(t);
-    return true;
+    rec.mat_ptr = mp.get();
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,79 @@
+#ifndef ALIAS_TABLE_H
+#define ALIAS_TABLE_H
+
+#include <vector>
+
+// Walker's alias method, built with Vose's algorithm: after O(n) setup, a discrete
+// distribution proportional to the given weights is sampled in O(1) from a single
+// uniform number.
+class alias_table {
+public:
+    alias_table() {}
+    alias_table(const std::vector<double>& weights) { build(weights); }
+
+    void build(const std::vector<double>& weights);
+
+    bool empty() const { return probabilities.empty(); }
+    size_t size() const { return probabilities.size(); }
+
+    // Index drawn with probability pmf(index), from u in [0, 1).
+    int sample(double u) const {
+        auto n = probabilities.size();
+        auto scaled = u * n;
+        auto i = static_cast<size_t>(scaled);
+        if (i >= n)
+            i = n - 1;
+        return scaled - i < probabilities[i] ? static_cast<int>(i) : aliases[i];
+    }
+
+    double pmf(int index) const { return masses[index]; }
+
+private:
+    std::vector<double> probabilities;  // chance of keeping bucket i rather than its alias
+    std::vector<int> aliases;
+    std::vector<double> masses;
+};
+
+void alias_table::build(const std::vector<double>& weights) {
+    auto n = weights.size();
+    probabilities.assign(n, 1.0);
+    aliases.assign(n, 0);
+    masses.assign(n, 0.0);
+    if (n == 0)
+        return;
+
+    auto total = 0.0;
+    for (auto w : weights)
+        total += w > 0 ? w : 0;
+
+    // All-zero weights fall back to uniform.
+    std::vector<double> scaled(n);
+    for (size_t i = 0; i < n; i++) {
+        masses[i] = total > 0 ? (weights[i] > 0 ? weights[i] / total : 0) : 1.0 / n;
+        scaled[i] = masses[i] * n;
+    }
+
+    std::vector<int> small, large;
+    for (size_t i = 0; i < n; i++)
+        (scaled[i] < 1 ? small : large).push_back(static_cast<int>(i));
+
+    while (!small.empty() && !large.empty()) {
+        int s = small.back();
+        small.pop_back();
+        int l = large.back();
+        large.pop_back();
+
+        probabilities[s] = scaled[s];
+        aliases[s] = l;
+        scaled[l] = (scaled[l] + scaled[s]) - 1;
+        (scaled[l] < 1 ? small : large).push_back(l);
+    }
+
+    // Whatever is left is 1 up to rounding.
+    for (int i : small)
+        probabilities[i] = 1;
+    for (int i : large)
+        probabilities[i] = 1;
+}
+
+#endif
@@ -18,6 +18,17 @@ public:
         return true;
     }
 
+    virtual bool hit_interval(const ray& r, double& t_enter, double& t_exit) const override {
+        t_enter = -infinity;
+        t_exit = infinity;
+        return aabb(box_min, box_max).clip(r, t_enter, t_exit);
+    }
+
+    virtual void find_lights(
+        const shared_ptr<hittable>& self, bool flipped, std::vector<light_candidate>& out) const override {
+        sides.find_lights(nullptr, flipped, out);
+    }
+
 public:
     point3 box_min;
     point3 box_max;
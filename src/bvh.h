@@ -24,10 +24,33 @@ public:
 
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+    virtual void find_lights(
+        const shared_ptr<hittable>& self, bool flipped, std::vector<light_candidate>& out) const override {
+        left->find_lights(left, flipped, out);
+        // A node over a single object holds it twice.
+        if (right != left)
+            right->find_lights(right, flipped, out);
+    }
+
+    virtual bool has_media() const override {
+        return media;
+    }
+
+    virtual double transmittance(const ray& r, double t_min, double t_max) const override {
+        if (!media || !box.hit(r, t_min, t_max))
+            return 1;
+
+        auto tr = left->transmittance(r, t_min, t_max);
+        if (right != left)
+            tr *= right->transmittance(r, t_min, t_max);
+        return tr;
+    }
+
 public:
     shared_ptr<hittable> left;
     shared_ptr<hittable> right;
     aabb box;
+    bool media = false;     // whether either child has media
 };
 
 bool bvh_node::bounding_box(double time0, double time1, aabb& output_box) const {
@@ -109,6 +132,7 @@ bvh_node::bvh_node(
         std::cerr << "No bounding box in bvh_node constructor.\n";
 
     box = surrounding_box(box_left, box_right);
+    media = left->has_media() || right->has_media();
 }
 
 #endif
\ No newline at end of file
@@ -16,7 +16,8 @@ public:
         double aperture,
         double focus_dist,
         double _time0 = 0,
-        double _time1 = 0)
+        double _time1 = 0,
+        int image_rows = 0)  // when given, rays carry a cone one pixel wide
     {
         auto theta = degrees_to_radians(vfov);
         auto h = tan(theta / 2);
@@ -35,17 +36,20 @@ public:
         lens_radius = aperture / 2;
         time0 = _time0;
         time1 = _time1;
+        pixel_spread = image_rows > 0 ? viewport_height / image_rows : 0;
     }
 
     ray get_ray(double s, double t) const {
         vec3 rd = lens_radius * random_in_unit_disk();
         vec3 offset = u * rd.x() + v * rd.y();
 
-        return ray(
+        ray r(
             origin + offset,
             lower_left_corner + s * horizontal + t * vertical - origin - offset,
             random_double(time0, time1)
         );
+        r.cone_spread = pixel_spread;
+        return r;
     }
 
 private:
@@ -56,5 +60,6 @@ private:
     vec3 u, v, w;
     double lens_radius;
     double time0, time1;  // shutter open/close times
+    double pixel_spread;  // angle subtended by one pixel
 };
 #endif
\ No newline at end of file
@@ -28,6 +28,12 @@ public:
         return boundary->bounding_box(time0, time1, output_box);
     }
 
+    virtual bool has_media() const override {
+        return true;
+    }
+
+    virtual double transmittance(const ray& r, double t_min, double t_max) const override;
+
 public:
     shared_ptr<hittable> boundary;
     shared_ptr<material> phase_function;
@@ -39,33 +45,30 @@ bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record&
     const bool enableDebug = false;
     const bool debugging = enableDebug && random_double() < 0.00001;
 
-    hit_record rec1, rec2;
+    double t_enter, t_exit;
 
-    if (!boundary->hit(r, -infinity, infinity, rec1))
+    if (!boundary->hit_interval(r, t_enter, t_exit))
         return false;
 
-    if (!boundary->hit(r, rec1.t + 0.0001, infinity, rec2))
-        return false;
-
-    if (debugging) std::cerr << "\nt_min=" << rec1.t << ", t_max=" << rec2.t << '\n';
+    if (debugging) std::cerr << "\nt_min=" << t_enter << ", t_max=" << t_exit << '\n';
 
-    if (rec1.t < t_min) rec1.t = t_min;
-    if (rec2.t > t_max) rec2.t = t_max;
+    if (t_enter < t_min) t_enter = t_min;
+    if (t_exit > t_max) t_exit = t_max;
 
-    if (rec1.t >= rec2.t)
+    if (t_enter >= t_exit)
         return false;
 
-    if (rec1.t < 0)
-        rec1.t = 0;
+    if (t_enter < 0)
+        t_enter = 0;
 
     const auto ray_length = r.direction().length();
-    const auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
+    const auto distance_inside_boundary = (t_exit - t_enter) * ray_length;
     const auto hit_distance = neg_inv_density * log(random_double());
 
     if (hit_distance > distance_inside_boundary)
         return false;
 
-    rec.t = rec1.t + hit_distance / ray_length;
+    rec.t = t_enter + hit_distance / ray_length;
     rec.p = r.at(rec.t);
 
     if (debugging) {
@@ -76,9 +79,28 @@ bool constant_medium::hit(const ray& r, double t_min, double t_max, hit_record&
 
     rec.normal = vec3(1, 0, 0);  // arbitrary
     rec.front_face = true;     // also arbitrary
-    rec.mat_ptr = phase_function;
+    rec.mat_ptr = phase_function.get();
+    rec.obj = this;
+    rec.deferred = false;
+    rec.transform_count = 0;
 
     return true;
 }
 
+double constant_medium::transmittance(const ray& r, double t_min, double t_max) const {
+    double t_enter, t_exit;
+
+    if (!boundary->hit_interval(r, t_enter, t_exit))
+        return 1;
+
+    if (t_enter < t_min) t_enter = t_min;
+    if (t_exit > t_max) t_exit = t_max;
+
+    if (t_enter >= t_exit)
+        return 1;
+
+    // Beer-Lambert over the distance inside the boundary.
+    return exp((t_exit - t_enter) * r.direction().length() / neg_inv_density);
+}
+
 #endif
\ No newline at end of file
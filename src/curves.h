@@ -0,0 +1,460 @@
+#ifndef CURVES_H
+#define CURVES_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "onb.h"
+#include "packing.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+enum class curve_type {
+    flat,       // a ribbon that always faces the ray
+    ribbon,     // a ribbon oriented by per-curve normals
+    tube        // a round tube
+};
+
+inline point3 lerp(const point3& a, const point3& b, double t) {
+    return (1 - t) * a + t * b;
+}
+
+// Cubic Bezier control points evaluated and split with de Casteljau.
+inline point3 bezier_eval(const point3 cp[4], double u, vec3* derivative = nullptr) {
+    point3 a[3] = { lerp(cp[0], cp[1], u), lerp(cp[1], cp[2], u), lerp(cp[2], cp[3], u) };
+    point3 b[2] = { lerp(a[0], a[1], u), lerp(a[1], a[2], u) };
+    if (derivative) {
+        if ((b[1] - b[0]).length_squared() > 0)
+            *derivative = 3 * (b[1] - b[0]);
+        else
+            *derivative = cp[3] - cp[0];
+    }
+    return lerp(b[0], b[1], u);
+}
+
+// Control points of the part of the curve between u0 and u1, by blossoming.
+inline void bezier_segment(const point3 cp[4], double u0, double u1, point3 out[4]) {
+    auto blossom = [&](double a, double b, double c) {
+        point3 p[3] = { lerp(cp[0], cp[1], a), lerp(cp[1], cp[2], a), lerp(cp[2], cp[3], a) };
+        point3 q[2] = { lerp(p[0], p[1], b), lerp(p[1], p[2], b) };
+        return lerp(q[0], q[1], c);
+    };
+    out[0] = blossom(u0, u0, u0);
+    out[1] = blossom(u0, u0, u1);
+    out[2] = blossom(u0, u1, u1);
+    out[3] = blossom(u1, u1, u1);
+}
+
+// A set of cubic Bezier curves with widths interpolated along them, for hair, fur and
+// grass. Curves are cut into segments_per_curve pieces whose control hulls bound them
+// much tighter than the whole curve's, and a BVH over the pieces stores them in leaves
+// of up to leaf_size. A curve costs 56 bytes of control points and widths, 8 more for
+// ribbon normals, 12 per segment and its share of the 36-byte nodes: about 200 bytes
+// in all at the default four segments.
+//
+// BVH nodes are axis-aligned boxes around the pieces' hulls. The pieces themselves
+// are tested against an oriented bound in ray space, a capsule around their chord,
+// before they are split, so that costs no memory.
+//
+// Intersection follows Nakamaru and Ohno as in pbrt: the segment is moved to a space
+// where the ray runs down +z, then split recursively until it is flat enough to test
+// as a line against the interpolated width.
+class curve_set : public hittable {
+public:
+    static const int leaf_size = 4;
+
+    curve_set(curve_type t, shared_ptr<material> m, int segments = 4)
+        : type(t), mp(m), segments_per_curve(segments) {}
+
+    void add(const point3 cp[4], double width0, double width1);
+
+    // For curve_type::ribbon: n0 and n1 orient the ribbon at its two ends.
+    void add(const point3 cp[4], double width0, double width1, const vec3& n0, const vec3& n1);
+
+    // Builds the BVH; call once after the last add().
+    void build();
+
+    size_t curve_count() const { return widths.size() / 2; }
+
+    virtual bool hit(
+        const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual void compute_surface_interaction(const ray& r, hit_record& rec) const override;
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+
+public:
+    struct segment {
+        uint32_t curve;
+        float u0, u1;
+    };
+
+    struct node {
+        float bmin[3];
+        float bmax[3];
+        int offset;     // first segment for leaves, right child for interior nodes
+        int count;      // number of segments, zero for interior nodes
+        int axis;
+    };
+
+    curve_type type;
+    shared_ptr<material> mp;
+    int segments_per_curve;
+
+    std::vector<float> points;      // 12 per curve
+    std::vector<float> widths;      // 2 per curve
+    std::vector<uint32_t> normals;  // 2 per curve, octahedral, ribbons only
+    std::vector<segment> segments;
+    std::vector<node> nodes;
+
+private:
+    void control_points(uint32_t curve, point3 cp[4]) const {
+        const float* p = &points[12 * static_cast<size_t>(curve)];
+        for (int i = 0; i < 4; i++)
+            cp[i] = point3(p[3 * i], p[3 * i + 1], p[3 * i + 2]);
+    }
+
+    double width_at(uint32_t curve, double u) const {
+        return (1 - u) * widths[2 * curve] + u * widths[2 * curve + 1];
+    }
+
+    vec3 ribbon_normal(uint32_t curve, double u) const {
+        return unit_vector((1 - u) * oct_decode(normals[2 * curve]) + u * oct_decode(normals[2 * curve + 1]));
+    }
+
+    int build_recursive(std::vector<aabb>& boxes, size_t start, size_t end);
+
+    // Ray space: origin at the ray origin, w along the ray.
+    struct ray_frame {
+        point3 origin;
+        onb axes;
+        double length;
+    };
+
+    bool intersect_segment(const ray_frame& f, const segment& s, double z_min, double& z_max,
+        double& hit_u, double& hit_v) const;
+
+    bool recursive_intersect(const ray_frame& f, uint32_t curve, const point3 cp[4], double u0, double u1,
+        int depth, double z_min, double& z_max, double& hit_u, double& hit_v) const;
+};
+
+void curve_set::add(const point3 cp[4], double width0, double width1) {
+    for (int i = 0; i < 4; i++)
+        for (int a = 0; a < 3; a++)
+            points.push_back(static_cast<float>(cp[i][a]));
+    widths.push_back(static_cast<float>(width0));
+    widths.push_back(static_cast<float>(width1));
+}
+
+void curve_set::add(const point3 cp[4], double width0, double width1, const vec3& n0, const vec3& n1) {
+    add(cp, width0, width1);
+    normals.resize(2 * (curve_count() - 1));
+    normals.push_back(oct_encode(unit_vector(n0)));
+    normals.push_back(oct_encode(unit_vector(n1)));
+}
+
+void curve_set::build() {
+    segments.clear();
+    nodes.clear();
+    if (type == curve_type::ribbon)
+        normals.resize(2 * curve_count(), oct_encode(vec3(0, 0, 1)));
+
+    std::vector<aabb> boxes;
+    for (uint32_t c = 0; c < curve_count(); c++) {
+        point3 cp[4];
+        control_points(c, cp);
+        for (int i = 0; i < segments_per_curve; i++) {
+            auto u0 = static_cast<double>(i) / segments_per_curve;
+            auto u1 = static_cast<double>(i + 1) / segments_per_curve;
+            point3 sub[4];
+            bezier_segment(cp, u0, u1, sub);
+
+            auto pad = 0.5 * fmax(width_at(c, u0), width_at(c, u1));
+            point3 lo = sub[0], hi = sub[0];
+            for (int k = 1; k < 4; k++) {
+                for (int a = 0; a < 3; a++) {
+                    lo[a] = fmin(lo[a], sub[k][a]);
+                    hi[a] = fmax(hi[a], sub[k][a]);
+                }
+            }
+            boxes.push_back(aabb(lo - vec3(pad, pad, pad), hi + vec3(pad, pad, pad)));
+            segments.push_back(segment{ c, static_cast<float>(u0), static_cast<float>(u1) });
+        }
+    }
+
+    if (segments.empty())
+        return;
+    nodes.reserve(2 * (segments.size() / leaf_size + 1));
+    build_recursive(boxes, 0, segments.size());
+}
+
+int curve_set::build_recursive(std::vector<aabb>& boxes, size_t start, size_t end) {
+    int index = static_cast<int>(nodes.size());
+    nodes.push_back(node());
+
+    aabb bounds = boxes[start];
+    point3 cmin(infinity, infinity, infinity);
+    point3 cmax(-infinity, -infinity, -infinity);
+    for (size_t i = start; i < end; i++) {
+        bounds = surrounding_box(bounds, boxes[i]);
+        for (int a = 0; a < 3; a++) {
+            auto c = 0.5 * (boxes[i].min()[a] + boxes[i].max()[a]);
+            cmin[a] = fmin(cmin[a], c);
+            cmax[a] = fmax(cmax[a], c);
+        }
+    }
+    for (int a = 0; a < 3; a++) {
+        nodes[index].bmin[a] = std::nextafterf(static_cast<float>(bounds.min()[a]), -HUGE_VALF);
+        nodes[index].bmax[a] = std::nextafterf(static_cast<float>(bounds.max()[a]), HUGE_VALF);
+    }
+
+    if (end - start <= leaf_size) {
+        nodes[index].offset = static_cast<int>(start);
+        nodes[index].count = static_cast<int>(end - start);
+        nodes[index].axis = 0;
+        return index;
+    }
+
+    int axis = 0;
+    for (int a = 1; a < 3; a++)
+        if (cmax[a] - cmin[a] > cmax[axis] - cmin[axis])
+            axis = a;
+
+    // Segments and their boxes are reordered together so leaves stay contiguous.
+    std::vector<size_t> order(end - start);
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = start + i;
+    auto mid = (end - start) / 2;
+    std::nth_element(order.begin(), order.begin() + mid, order.end(), [&](size_t a, size_t b) {
+        return boxes[a].min()[axis] + boxes[a].max()[axis] < boxes[b].min()[axis] + boxes[b].max()[axis];
+    });
+    std::vector<segment> sorted_segments(order.size());
+    std::vector<aabb> sorted_boxes(order.size());
+    for (size_t i = 0; i < order.size(); i++) {
+        sorted_segments[i] = segments[order[i]];
+        sorted_boxes[i] = boxes[order[i]];
+    }
+    std::copy(sorted_segments.begin(), sorted_segments.end(), segments.begin() + start);
+    std::copy(sorted_boxes.begin(), sorted_boxes.end(), boxes.begin() + start);
+
+    build_recursive(boxes, start, start + mid);
+    int right = build_recursive(boxes, start + mid, end);
+
+    nodes[index].offset = right;
+    nodes[index].count = 0;
+    nodes[index].axis = axis;
+    return index;
+}
+
+bool curve_set::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    if (nodes.empty())
+        return false;
+
+    ray_frame frame;
+    frame.origin = r.origin();
+    frame.length = r.direction().length();
+    frame.axes.build_from_w(r.direction());
+
+    double inv_dir[3] = { 1 / r.direction().x(), 1 / r.direction().y(), 1 / r.direction().z() };
+    double closest = t_max;
+    double z_max = t_max * frame.length;
+    const double z_min = t_min * frame.length;
+    int hit_curve = -1;
+    double hit_u = 0, hit_v = 0;
+
+    int stack[64];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+
+    while (stack_size > 0) {
+        const node& n = nodes[stack[--stack_size]];
+
+        auto lo = t_min;
+        auto hi = closest;
+        bool miss = false;
+        for (int a = 0; a < 3 && !miss; a++) {
+            auto t0 = (n.bmin[a] - r.origin()[a]) * inv_dir[a];
+            auto t1 = (n.bmax[a] - r.origin()[a]) * inv_dir[a];
+            if (inv_dir[a] < 0)
+                std::swap(t0, t1);
+            lo = t0 > lo ? t0 : lo;
+            hi = t1 < hi ? t1 : hi;
+            miss = hi < lo;
+        }
+        if (miss)
+            continue;
+
+        if (n.count > 0) {
+            for (int i = n.offset; i < n.offset + n.count; i++) {
+                if (intersect_segment(frame, segments[i], z_min, z_max, hit_u, hit_v)) {
+                    hit_curve = static_cast<int>(segments[i].curve);
+                    closest = z_max / frame.length;
+                }
+            }
+            continue;
+        }
+
+        int near_child = static_cast<int>(&n - nodes.data()) + 1;
+        int far_child = n.offset;
+        if (r.direction()[n.axis] < 0)
+            std::swap(near_child, far_child);
+        stack[stack_size++] = far_child;
+        stack[stack_size++] = near_child;
+    }
+
+    if (hit_curve < 0)
+        return false;
+
+    rec.set_deferred(this, closest, hit_curve);
+    rec.u = hit_u;
+    rec.v = hit_v;
+    return true;
+}
+
+bool curve_set::intersect_segment(const ray_frame& f, const segment& s, double z_min, double& z_max,
+    double& hit_u, double& hit_v) const
+{
+    point3 cp[4], sub[4];
+    control_points(s.curve, cp);
+    bezier_segment(cp, s.u0, s.u1, sub);
+
+    point3 local[4];
+    for (int i = 0; i < 4; i++) {
+        auto d = sub[i] - f.origin;
+        local[i] = point3(dot(d, f.axes.u()), dot(d, f.axes.v()), dot(d, f.axes.w()));
+    }
+
+    // Enough splits that the remaining pieces deviate from a line by under 5% of the
+    // width (pbrt's bound from the second differences of the control points).
+    double l0 = 0;
+    for (int i = 0; i < 2; i++)
+        for (int a = 0; a < 3; a++)
+            l0 = fmax(l0, fabs(local[i][a] - 2 * local[i + 1][a] + local[i + 2][a]));
+    auto eps = 0.05 * fmax(width_at(s.curve, s.u0), width_at(s.curve, s.u1));
+    int depth = 0;
+    if (l0 > 0 && eps > 0)
+        depth = static_cast<int>(clamp(0.5 * log2(1.41421356237 * 6 * l0 / (8 * eps)), 0.0, 10.0));
+
+    return recursive_intersect(f, s.curve, local, s.u0, s.u1, depth, z_min, z_max, hit_u, hit_v);
+}
+
+bool curve_set::recursive_intersect(const ray_frame& f, uint32_t curve, const point3 cp[4], double u0, double u1,
+    int depth, double z_min, double& z_max, double& hit_u, double& hit_v) const
+{
+    auto half_width = 0.5 * fmax(width_at(curve, u0), width_at(curve, u1));
+    double lo[3], hi[3];
+    for (int a = 0; a < 3; a++) {
+        lo[a] = fmin(fmin(cp[0][a], cp[1][a]), fmin(cp[2][a], cp[3][a])) - half_width;
+        hi[a] = fmax(fmax(cp[0][a], cp[1][a]), fmax(cp[2][a], cp[3][a])) + half_width;
+    }
+    if (lo[0] > 0 || hi[0] < 0 || lo[1] > 0 || hi[1] < 0 || hi[2] < z_min || lo[2] > z_max)
+        return false;
+
+    // Seen down the ray, the piece also lies within a capsule around its chord
+    // cp[0]-cp[3], as wide as the farther inner control point plus the half width. For
+    // pieces running diagonally across the ray that is much tighter than the box.
+    auto chord_x = cp[3].x() - cp[0].x();
+    auto chord_y = cp[3].y() - cp[0].y();
+    auto chord_length_squared = chord_x * chord_x + chord_y * chord_y;
+    auto chord_distance = [&](double x, double y) {
+        auto s = chord_length_squared > 0
+            ? clamp(((x - cp[0].x()) * chord_x + (y - cp[0].y()) * chord_y) / chord_length_squared, 0.0, 1.0) : 0.0;
+        auto ex = x - cp[0].x() - s * chord_x;
+        auto ey = y - cp[0].y() - s * chord_y;
+        return sqrt(ex * ex + ey * ey);
+    };
+    auto capsule_radius = fmax(chord_distance(cp[1].x(), cp[1].y()), chord_distance(cp[2].x(), cp[2].y())) + half_width;
+    if (chord_distance(0, 0) > capsule_radius)
+        return false;
+
+    if (depth > 0) {
+        auto mid = 0.5 * (u0 + u1);
+        point3 left[4], right[4];
+        bezier_segment(cp, 0, 0.5, left);
+        bezier_segment(cp, 0.5, 1, right);
+        bool hit_left = recursive_intersect(f, curve, left, u0, mid, depth - 1, z_min, z_max, hit_u, hit_v);
+        bool hit_right = recursive_intersect(f, curve, right, mid, u1, depth - 1, z_min, z_max, hit_u, hit_v);
+        return hit_left || hit_right;
+    }
+
+    // The piece is now close to the line cp[0]-cp[3]. Reject rays past either end,
+    // using the end tangents so neighbouring pieces meet without gaps.
+    if ((cp[1].y() - cp[0].y()) * -cp[0].y() + cp[0].x() * (cp[0].x() - cp[1].x()) < 0)
+        return false;
+    if ((cp[2].y() - cp[3].y()) * -cp[3].y() + cp[3].x() * (cp[3].x() - cp[2].x()) < 0)
+        return false;
+
+    auto dx = cp[3].x() - cp[0].x();
+    auto dy = cp[3].y() - cp[0].y();
+    auto denom = dx * dx + dy * dy;
+    if (denom == 0)
+        return false;
+    auto w = clamp((-cp[0].x() * dx - cp[0].y() * dy) / denom, 0.0, 1.0);
+    auto u = u0 + w * (u1 - u0);
+
+    auto width = width_at(curve, u);
+    if (type == curve_type::ribbon) {
+        // A ribbon seen edge-on is thinner.
+        auto n = ribbon_normal(curve, u);
+        width *= fabs(dot(n, f.axes.w()));
+    }
+
+    vec3 tangent;
+    auto pc = bezier_eval(cp, w, &tangent);
+    auto distance_squared = pc.x() * pc.x() + pc.y() * pc.y();
+    if (distance_squared > 0.25 * width * width)
+        return false;
+
+    auto z = pc.z();
+    if (type == curve_type::tube)
+        z -= sqrt(fmax(0.0, 0.25 * width * width - distance_squared));
+    if (z < z_min || z > z_max)
+        return false;
+
+    z_max = z;
+    hit_u = u;
+    auto offset = sqrt(distance_squared) / width;
+    auto side = tangent.x() * -pc.y() - tangent.y() * -pc.x();
+    hit_v = side > 0 ? 0.5 + offset : 0.5 - offset;
+    return true;
+}
+
+void curve_set::compute_surface_interaction(const ray& r, hit_record& rec) const {
+    rec.p = r.at(rec.t);
+
+    point3 cp[4];
+    control_points(static_cast<uint32_t>(rec.prim_id), cp);
+    vec3 tangent;
+    auto center = bezier_eval(cp, rec.u, &tangent);
+    tangent = unit_vector(tangent);
+
+    auto across = [&](const vec3& v) { return v - dot(v, tangent) * tangent; };
+
+    vec3 n;
+    if (type == curve_type::tube)
+        n = across(rec.p - center);
+    else if (type == curve_type::ribbon)
+        n = across(ribbon_normal(static_cast<uint32_t>(rec.prim_id), rec.u));
+    else
+        n = -across(r.direction());
+
+    if (n.length_squared() < 1e-24)
+        n = -across(r.direction());
+    if (n.length_squared() < 1e-24)
+        n = -r.direction();
+    rec.set_face_normal(r, unit_vector(n));
+    rec.mat_ptr = mp.get();
+}
+
+bool curve_set::bounding_box(double time0, double time1, aabb& output_box) const {
+    if (nodes.empty())
+        return false;
+
+    const node& root = nodes[0];
+    output_box = aabb(
+        point3(root.bmin[0], root.bmin[1], root.bmin[2]),
+        point3(root.bmax[0], root.bmax[1], root.bmax[2]));
+    return true;
+}
+
+#endif
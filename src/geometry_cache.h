@@ -0,0 +1,215 @@
+#ifndef GEOMETRY_CACHE_H
+#define GEOMETRY_CACHE_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+// A thread-safe LRU cache of geometry built on demand, bounded by a memory budget in
+// bytes. Entries are handed out as shared_ptrs, so an evicted entry stays valid for
+// the rays still using it and is freed when the last of them lets go. Until then it
+// is retired: its bytes still count in memory_used() and against the budget, so the
+// cache evicts more to make up for it.
+//
+// Traversal goes through get_pinned(), which first looks in a small direct-mapped table
+// of entries the calling thread used recently. Geometry found there costs neither the
+// lock nor a reference count. Every eviction starts a new epoch, and a thread drops
+// all its pins from an earlier epoch on its next call, so pins only outlive an
+// eviction until their thread comes back to the cache.
+class geometry_cache {
+public:
+    struct key {
+        const void* owner;
+        size_t id;
+
+        bool operator==(const key& other) const {
+            return owner == other.owner && id == other.id;
+        }
+    };
+
+    static const int pins_per_thread = 64;
+
+    explicit geometry_cache(size_t budget_bytes) : budget(budget_bytes), id(next_id()) {}
+
+    // Returns the entry for k, calling build(bytes) to create it on a miss. The lock is
+    // not held while building, so two threads missing the same key may both build it;
+    // the first one inserted wins. A build that returns null is passed on but not
+    // cached, so a later call tries again.
+    template <typename Builder>
+    shared_ptr<hittable> get(const key& k, Builder build);
+
+    // Like get(), but served from the calling thread's pins when possible. The pointer
+    // stays valid until the thread's next call to get_pinned() that misses its pins.
+    template <typename Builder>
+    const hittable* get_pinned(const key& k, Builder build);
+
+    // Whether k is resident, without touching its place in the LRU order.
+    bool contains(const key& k) const {
+        std::lock_guard<std::mutex> guard(lock);
+        return index.count(k) != 0;
+    }
+
+    // Bytes of resident and retired entries.
+    size_t memory_used() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return used + retired_bytes();
+    }
+
+    size_t memory_budget() const { return budget; }
+
+public:
+    size_t hits = 0;
+    size_t misses = 0;
+
+private:
+    struct key_hash {
+        size_t operator()(const key& k) const {
+            return std::hash<const void*>()(k.owner) ^ (std::hash<size_t>()(k.id) * 0x9e3779b97f4a7c15ull);
+        }
+    };
+
+    struct entry {
+        key k;
+        shared_ptr<hittable> value;
+        size_t bytes;
+    };
+
+    // Pins are matched by cache id rather than address, so a new cache allocated where
+    // an old one was never sees the old cache's geometry.
+    struct pin {
+        uint64_t cache_id = 0;
+        uint64_t epoch = 0;
+        key k{ nullptr, 0 };
+        shared_ptr<hittable> value;
+    };
+
+    // An evicted entry someone still held at the time.
+    struct retired_entry {
+        std::weak_ptr<hittable> value;
+        size_t bytes;
+    };
+
+    // Forgets the retired entries that have been freed since and returns the bytes of
+    // the rest. Called with the lock held.
+    size_t retired_bytes() const {
+        size_t bytes = 0;
+        for (auto it = retired.begin(); it != retired.end();) {
+            if (it->value.expired()) {
+                it = retired.erase(it);
+            }
+            else {
+                bytes += it->bytes;
+                ++it;
+            }
+        }
+        return bytes;
+    }
+
+    struct pin_set {
+        pin pins[pins_per_thread];
+    };
+
+    static pin_set& thread_pins() {
+        thread_local pin_set set;
+        return set;
+    }
+
+    static uint64_t next_id() {
+        static std::atomic<uint64_t> ids(0);
+        return ++ids;
+    }
+
+    mutable std::mutex lock;
+    std::list<entry> lru;   // most recently used first
+    std::unordered_map<key, std::list<entry>::iterator, key_hash> index;
+    mutable std::list<retired_entry> retired;
+    size_t budget;
+    size_t used = 0;
+    uint64_t id;
+    std::atomic<uint64_t> epoch{ 0 };
+};
+
+template <typename Builder>
+shared_ptr<hittable> geometry_cache::get(const key& k, Builder build) {
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = index.find(k);
+        if (it != index.end()) {
+            hits++;
+            lru.splice(lru.begin(), lru, it->second);
+            return it->second->value;
+        }
+        misses++;
+    }
+
+    size_t bytes = 0;
+    shared_ptr<hittable> value = build(bytes);
+    if (!value)
+        return value;
+
+    std::lock_guard<std::mutex> guard(lock);
+    auto it = index.find(k);
+    if (it != index.end()) {
+        lru.splice(lru.begin(), lru, it->second);
+        return it->second->value;
+    }
+
+    lru.push_front(entry{ k, value, bytes });
+    index[k] = lru.begin();
+    used += bytes;
+
+    // Never evict the entry just added, even if it alone exceeds the budget.
+    auto in_use = retired_bytes();
+    bool evicted = false;
+    while (used + in_use > budget && lru.size() > 1) {
+        auto& last = lru.back();
+        used -= last.bytes;
+        if (last.value.use_count() > 1) {
+            retired.push_back(retired_entry{ last.value, last.bytes });
+            in_use += last.bytes;
+        }
+        index.erase(last.k);
+        lru.pop_back();
+        evicted = true;
+    }
+    if (evicted)
+        epoch++;
+
+    return value;
+}
+
+template <typename Builder>
+const hittable* geometry_cache::get_pinned(const key& k, Builder build) {
+    auto& set = thread_pins();
+    auto& slot = set.pins[key_hash()(k) % pins_per_thread];
+    auto current = epoch.load(std::memory_order_relaxed);
+    if (slot.cache_id == id && slot.k == k && slot.epoch == current)
+        return slot.value.get();
+
+    // Something was evicted since this thread last pinned; let go of everything it
+    // pinned before, so that nothing evicted is kept alive by this thread.
+    for (auto& p : set.pins) {
+        if (p.cache_id == id && p.epoch != current) {
+            p.value.reset();
+            p.cache_id = 0;
+        }
+    }
+
+    // An eviction while get() runs may already have taken the entry, so the pin
+    // belongs to the epoch from before it.
+    auto before = epoch.load(std::memory_order_relaxed);
+    slot.value = get(k, build);
+    slot.cache_id = slot.value ? id : 0;
+    slot.epoch = before;
+    slot.k = k;
+    return slot.value.get();
+}
+
+#endif
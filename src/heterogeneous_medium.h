@@ -0,0 +1,124 @@
+#ifndef HETEROGENEOUS_MEDIUM_H
+#define HETEROGENEOUS_MEDIUM_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "material.h"
+#include "volume_grid.h"
+
+// A participating medium whose density varies over a volume_grid. Scattering
+// distances are sampled with delta tracking against a coarse majorant grid, and
+// transmittance() estimates attenuation with ratio tracking. Both only evaluate the
+// density at the tentative collisions, never on a fixed march step.
+class heterogeneous_medium : public hittable {
+public:
+    heterogeneous_medium(
+        shared_ptr<volume_grid> g, double scale, shared_ptr<texture> a, int majorant_resolution = 16)
+        : grid(g),
+        density_scale(scale),
+        majorants(*g, majorant_resolution, scale),
+        phase_function(make_shared<isotropic>(a))
+    {}
+
+    heterogeneous_medium(
+        shared_ptr<volume_grid> g, double scale, color c, int majorant_resolution = 16)
+        : grid(g),
+        density_scale(scale),
+        majorants(*g, majorant_resolution, scale),
+        phase_function(make_shared<isotropic>(c))
+    {}
+
+    virtual bool hit(
+        const ray& r, double t_min, double t_max, hit_record& rec) const override;
+
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+        output_box = grid->bounds();
+        return true;
+    }
+
+    virtual bool has_media() const override {
+        return true;
+    }
+
+    virtual double transmittance(const ray& r, double t_min, double t_max) const override;
+
+public:
+    shared_ptr<volume_grid> grid;
+    double density_scale;
+    majorant_grid majorants;
+    shared_ptr<material> phase_function;
+};
+
+bool heterogeneous_medium::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    const auto ray_length = r.direction().length();
+    volume_grid::cache lookup;
+    double t_hit = 0;
+
+    bool scattered = majorants.traverse(r, t_min, t_max, [&](double t0, double t1, double majorant) {
+        if (majorant <= 0)
+            return false;
+
+        // Exponential steps against the majorant; a tentative collision is real with
+        // probability density / majorant. Restarting at each cell is unbiased since
+        // the exponential distribution is memoryless.
+        auto t = t0;
+        while (true) {
+            t -= log(1 - random_double()) / (majorant * ray_length);
+            if (t >= t1)
+                return false;
+
+            if (random_double() * majorant < density_scale * grid->cached_density(r.at(t), lookup)) {
+                t_hit = t;
+                return true;
+            }
+        }
+    });
+
+    if (!scattered)
+        return false;
+
+    rec.t = t_hit;
+    rec.p = r.at(rec.t);
+    rec.normal = vec3(1, 0, 0);  // arbitrary
+    rec.front_face = true;     // also arbitrary
+    rec.mat_ptr = phase_function.get();
+    rec.obj = this;
+    rec.deferred = false;
+    rec.transform_count = 0;
+
+    return true;
+}
+
+double heterogeneous_medium::transmittance(const ray& r, double t_min, double t_max) const {
+    const auto ray_length = r.direction().length();
+    volume_grid::cache lookup;
+    auto tr = 1.0;
+
+    majorants.traverse(r, t_min, t_max, [&](double t0, double t1, double majorant) {
+        if (majorant <= 0)
+            return false;
+
+        auto t = t0;
+        while (true) {
+            t -= log(1 - random_double()) / (majorant * ray_length);
+            if (t >= t1)
+                return false;
+
+            tr *= 1 - density_scale * grid->cached_density(r.at(t), lookup) / majorant;
+
+            // Russian roulette once the estimate is small, keeping it unbiased.
+            if (tr < 0.1) {
+                if (random_double() < 0.5) {
+                    tr = 0;
+                    return true;
+                }
+                tr *= 2;
+            }
+        }
+    });
+
+    return tr;
+}
+
+#endif
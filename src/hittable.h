@@ -5,27 +5,80 @@
 #include "rtweekend.h"
 #include "aabb.h"
 
+#include <vector>
+
 class material;
+class hittable;
 
 struct hit_record {
     point3 p;
     vec3 normal;
-    shared_ptr<material> mat_ptr;
+    // Non-owning: materials are kept alive by the primitives that reference them, so
+    // recording a hit never touches a shared_ptr reference count.
+    const material* mat_ptr = nullptr;
     double t;
     double u;
     double v;
     bool front_face;
 
+    // Set by the primitive that produced the hit. While deferred is true only t and
+    // prim_id are valid, plus the barycentrics in u and v for triangles; the remaining
+    // fields are filled in by compute_surface_interaction() once the closest hit is
+    // known.
+    const hittable* obj = nullptr;
+    int prim_id = 0;
+    bool deferred = false;
+
+    // Transforms the hit was returned through, innermost first. Until
+    // compute_surface_interaction() applies them, after the primitive's own part, the
+    // surface fields are in the innermost object's space.
+    static const int max_transforms = 4;
+    const hittable* transforms[max_transforms];
+    int transform_count = 0;
+
     inline void set_face_normal(const ray& r, const vec3& outward_normal) {
         front_face = dot(r.direction(), outward_normal) < 0;
         normal = front_face ? outward_normal : -outward_normal;
     }
+
+    inline void set_deferred(const hittable* object, double hit_t, int id = 0) {
+        t = hit_t;
+        obj = object;
+        prim_id = id;
+        deferred = true;
+        transform_count = 0;
+    }
+
+    inline void compute_surface_interaction(const ray& r);
+};
+
+// A primitive that can be sampled as a light, found by hittable::find_lights(). It
+// is a light if its material emits. Emission leaves the front face, so axis is the
+// normal on that side and cos_theta bounds the normals around it, -1 for shapes that
+// face every way.
+struct light_candidate {
+    shared_ptr<hittable> object;
+    const material* mat;
+    vec3 axis;
+    double cos_theta;
 };
 
 class hittable {
 public:
+    // Records the closest hit with t in [t_min, t_max]. rec is written only when this
+    // returns true, so one record can be passed to every candidate in turn.
     virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const = 0;
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const = 0;
+
+    // Fills in p, normal, u, v and mat_ptr for a hit this object recorded with
+    // set_deferred(). Called once per ray, on the closest hit only.
+    virtual void compute_surface_interaction(const ray& r, hit_record& rec) const {}
+
+    // For a closed boundary, the ray parameters where the line enters and leaves it.
+    // The default finds them with two hit() calls; shapes that can solve for both at
+    // once override it.
+    virtual bool hit_interval(const ray& r, double& t_enter, double& t_exit) const;
+
     virtual double pdf_value(const point3& o, const vec3& v) const {
         return 0.0;
     }
@@ -33,8 +86,193 @@ public:
     virtual vec3 random(const vec3& o) const {
         return vec3(1, 0, 0);
     }
+
+    // Area of the surface random() samples, for weighting lights by power.
+    virtual double surface_area() const {
+        return 0;
+    }
+
+    // Appends the primitives under this object that implement random() and
+    // pdf_value(). self is the pointer this object is held by, and flipped tells
+    // whether an enclosing flip_face turned its front face around. Transforms pass
+    // their children on wrapped in a transformed_light, so they are sampled in world
+    // space.
+    virtual void find_lights(
+        const shared_ptr<hittable>& self, bool flipped, std::vector<light_candidate>& out) const {}
+
+    // The primitive whose hits are this light's: hit_record::obj names it. Itself,
+    // except for a transformed_light.
+    virtual const hittable* light_primitive() const {
+        return this;
+    }
+
+    // For transforms: the ray in the space of the transformed object, and the change of
+    // a hit found with that ray back to this object's space. A transform's hit() adds
+    // itself to rec.transforms, so both run only for the closest hit.
+    virtual ray local_ray(const ray& r) const {
+        return r;
+    }
+
+    virtual void transform_hit(const ray& local_r, hit_record& rec) const {}
+
+    // Whether this is a participating medium or has one under it. Shadow rays pass
+    // through media instead of being blocked by the collisions hit() samples in them,
+    // and are attenuated by transmittance().
+    virtual bool has_media() const {
+        return false;
+    }
+
+    // Fraction of light that passes through the media under this object along the ray
+    // between t_min and t_max. Surfaces let everything through; hit() accounts for them.
+    virtual double transmittance(const ray& r, double t_min, double t_max) const {
+        return 1;
+    }
+};
+
+inline void hit_record::compute_surface_interaction(const ray& r) {
+    if (transform_count == 0) {
+        if (deferred) {
+            deferred = false;
+            obj->compute_surface_interaction(r, *this);
+        }
+        return;
+    }
+
+    // The ray in the space of each transform's object, from the outermost inwards.
+    ray local[max_transforms + 1];
+    local[transform_count] = r;
+    for (int i = transform_count; i > 0; i--)
+        local[i - 1] = transforms[i - 1]->local_ray(local[i]);
+
+    if (deferred) {
+        deferred = false;
+        obj->compute_surface_interaction(local[0], *this);
+    }
+
+    int count = transform_count;
+    transform_count = 0;
+    for (int i = 0; i < count; i++)
+        transforms[i]->transform_hit(local[i], *this);
+}
+
+// Called by a transform whose object reported rec. With room on the record the
+// transform is applied later, on the closest hit only; otherwise right away.
+inline void defer_transform(const hittable* transform, const ray& local_r, hit_record& rec) {
+    if (rec.transform_count < hit_record::max_transforms) {
+        rec.transforms[rec.transform_count++] = transform;
+        return;
+    }
+
+    rec.compute_surface_interaction(local_r);
+    transform->transform_hit(local_r, rec);
+}
+
+bool hittable::hit_interval(const ray& r, double& t_enter, double& t_exit) const {
+    hit_record rec;
+
+    if (!hit(r, -infinity, infinity, rec))
+        return false;
+    t_enter = rec.t;
+
+    if (!hit(r, t_enter + 0.0001, infinity, rec))
+        return false;
+    t_exit = rec.t;
+
+    return true;
+}
+
+// A light under a transform, seen from world space: random() and pdf_value() take
+// world-space points and directions and carry them through the transform to the
+// light. Translations and rotations keep solid angles, so the density is the
+// light's own.
+class transformed_light : public hittable {
+public:
+    transformed_light(shared_ptr<hittable> _transform, shared_ptr<hittable> _light);
+
+    virtual bool hit(
+        const ray& r, double t_min, double t_max, hit_record& rec) const override {
+        auto local_r = transform->local_ray(r);
+        if (!light->hit(local_r, t_min, t_max, rec))
+            return false;
+
+        defer_transform(transform.get(), local_r, rec);
+        return true;
+    }
+
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+        output_box = box;
+        return hasbox;
+    }
+
+    virtual double pdf_value(const point3& o, const vec3& v) const override {
+        auto local_r = transform->local_ray(ray(o, v));
+        return light->pdf_value(local_r.origin(), local_r.direction());
+    }
+
+    virtual vec3 random(const vec3& o) const override {
+        auto local_r = transform->local_ray(ray(o, vec3(0, 0, 0)));
+        return to_world(local_r.origin() + light->random(local_r.origin())) - o;
+    }
+
+    virtual double surface_area() const override {
+        return light->surface_area();
+    }
+
+    virtual const hittable* light_primitive() const override {
+        return light->light_primitive();
+    }
+
+    // A point in the light's space moved to world space, by the transform's
+    // transform_hit().
+    point3 to_world(const point3& p) const {
+        hit_record rec;
+        rec.p = p;
+        rec.normal = vec3(0, 0, 1);
+        transform->transform_hit(ray(p, vec3(0, 0, 1)), rec);
+        return rec.p;
+    }
+
+public:
+    shared_ptr<hittable> transform;
+    shared_ptr<hittable> light;
+    bool hasbox;
+    aabb box;
 };
 
+transformed_light::transformed_light(shared_ptr<hittable> _transform, shared_ptr<hittable> _light)
+    : transform(_transform), light(_light)
+{
+    aabb local_box;
+    hasbox = light->bounding_box(0, 1, local_box);
+
+    point3 min(infinity, infinity, infinity);
+    point3 max(-infinity, -infinity, -infinity);
+
+    for (int i = 0; i < 8; i++) {
+        auto corner = to_world(point3(
+            (i & 1) ? local_box.max().x() : local_box.min().x(),
+            (i & 2) ? local_box.max().y() : local_box.min().y(),
+            (i & 4) ? local_box.max().z() : local_box.min().z()));
+        for (int c = 0; c < 3; c++) {
+            min[c] = fmin(min[c], corner[c]);
+            max[c] = fmax(max[c], corner[c]);
+        }
+    }
+
+    box = aabb(min, max);
+}
+
+// Wraps the lights a transform's object appended from first on in transformed_lights,
+// with their emission axes turned into world space.
+inline void transform_lights(
+    const shared_ptr<hittable>& transform, std::vector<light_candidate>& out, size_t first) {
+    for (auto i = first; i < out.size(); i++) {
+        auto light = make_shared<transformed_light>(transform, out[i].object);
+        out[i].axis = light->to_world(out[i].axis) - light->to_world(point3(0, 0, 0));
+        out[i].object = light;
+    }
+}
+
 class translate : public hittable {
 public:
     translate(shared_ptr<hittable> p, const vec3& displacement)
@@ -45,19 +283,52 @@ public:
 
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
 
+    virtual bool hit_interval(const ray& r, double& t_enter, double& t_exit) const override {
+        return ptr->hit_interval(moved(r), t_enter, t_exit);
+    }
+
+    virtual ray local_ray(const ray& r) const override {
+        return moved(r);
+    }
+
+    virtual void find_lights(
+        const shared_ptr<hittable>& self, bool flipped, std::vector<light_candidate>& out) const override {
+        auto first = out.size();
+        ptr->find_lights(ptr, flipped, out);
+        transform_lights(self, out, first);
+    }
+
+    virtual void transform_hit(const ray& local_r, hit_record& rec) const override {
+        rec.p += offset;
+        rec.set_face_normal(local_r, rec.normal);
+    }
+
+    virtual bool has_media() const override {
+        return ptr->has_media();
+    }
+
+    virtual double transmittance(const ray& r, double t_min, double t_max) const override {
+        return ptr->transmittance(moved(r), t_min, t_max);
+    }
+
+    // The ray in the object's untranslated space.
+    ray moved(const ray& r) const {
+        ray moved_r = r;
+        moved_r.orig = r.origin() - offset;
+        return moved_r;
+    }
+
 public:
     shared_ptr<hittable> ptr;
     vec3 offset;
 };
 
 bool translate::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    ray moved_r(r.origin() - offset, r.direction(), r.time());
+    ray moved_r = moved(r);
     if (!ptr->hit(moved_r, t_min, t_max, rec))
         return false;
 
-    rec.p += offset;
-    rec.set_face_normal(moved_r, rec.normal);
-
+    defer_transform(this, moved_r, rec);
     return true;
 }
 
@@ -84,6 +355,34 @@ public:
         return hasbox;
     }
 
+    virtual bool hit_interval(const ray& r, double& t_enter, double& t_exit) const override {
+        return ptr->hit_interval(rotated(r), t_enter, t_exit);
+    }
+
+    virtual ray local_ray(const ray& r) const override {
+        return rotated(r);
+    }
+
+    virtual void find_lights(
+        const shared_ptr<hittable>& self, bool flipped, std::vector<light_candidate>& out) const override {
+        auto first = out.size();
+        ptr->find_lights(ptr, flipped, out);
+        transform_lights(self, out, first);
+    }
+
+    virtual void transform_hit(const ray& local_r, hit_record& rec) const override;
+
+    virtual bool has_media() const override {
+        return ptr->has_media();
+    }
+
+    virtual double transmittance(const ray& r, double t_min, double t_max) const override {
+        return ptr->transmittance(rotated(r), t_min, t_max);
+    }
+
+    // The ray in the object's unrotated space.
+    ray rotated(const ray& r) const;
+
 public:
     shared_ptr<hittable> ptr;
     double sin_theta;
@@ -124,21 +423,29 @@ rotate_y::rotate_y(shared_ptr<hittable> p, double angle) : ptr(p) {
     bbox = aabb(min, max);
 }
 
-bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    auto origin = r.origin();
-    auto direction = r.direction();
+ray rotate_y::rotated(const ray& r) const {
+    ray rotated_r = r;
 
-    origin[0] = cos_theta * r.origin()[0] - sin_theta * r.origin()[2];
-    origin[2] = sin_theta * r.origin()[0] + cos_theta * r.origin()[2];
+    rotated_r.orig[0] = cos_theta * r.origin()[0] - sin_theta * r.origin()[2];
+    rotated_r.orig[2] = sin_theta * r.origin()[0] + cos_theta * r.origin()[2];
 
-    direction[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
-    direction[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
+    rotated_r.dir[0] = cos_theta * r.direction()[0] - sin_theta * r.direction()[2];
+    rotated_r.dir[2] = sin_theta * r.direction()[0] + cos_theta * r.direction()[2];
 
-    ray rotated_r(origin, direction, r.time());
+    return rotated_r;
+}
+
+bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    ray rotated_r = rotated(r);
 
     if (!ptr->hit(rotated_r, t_min, t_max, rec))
         return false;
 
+    defer_transform(this, rotated_r, rec);
+    return true;
+}
+
+void rotate_y::transform_hit(const ray& local_r, hit_record& rec) const {
     auto p = rec.p;
     auto normal = rec.normal;
 
@@ -149,9 +456,7 @@ bool rotate_y::hit(const ray& r, double t_min, double t_max, hit_record& rec) co
     normal[2] = -sin_theta * rec.normal[0] + cos_theta * rec.normal[2];
 
     rec.p = p;
-    rec.set_face_normal(rotated_r, normal);
-
-    return true;
+    rec.set_face_normal(local_r, normal);
 }
 
 class flip_face : public hittable {
@@ -164,14 +469,35 @@ public:
         if (!ptr->hit(r, t_min, t_max, rec))
             return false;
 
-        rec.front_face = !rec.front_face;
+        defer_transform(this, r, rec);
         return true;
     }
 
+    virtual void transform_hit(const ray& local_r, hit_record& rec) const override {
+        rec.front_face = !rec.front_face;
+    }
+
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
         return ptr->bounding_box(time0, time1, output_box);
     }
 
+    virtual bool hit_interval(const ray& r, double& t_enter, double& t_exit) const override {
+        return ptr->hit_interval(r, t_enter, t_exit);
+    }
+
+    virtual bool has_media() const override {
+        return ptr->has_media();
+    }
+
+    virtual double transmittance(const ray& r, double t_min, double t_max) const override {
+        return ptr->transmittance(r, t_min, t_max);
+    }
+
+    virtual void find_lights(
+        const shared_ptr<hittable>& self, bool flipped, std::vector<light_candidate>& out) const override {
+        ptr->find_lights(ptr, !flipped, out);
+    }
+
 public:
     shared_ptr<hittable> ptr;
 };
@@ -15,8 +15,11 @@ public:
     hittable_list() {}
     hittable_list(shared_ptr<hittable> object) { add(object); }
 
-    void clear() { objects.clear(); }
-    void add(shared_ptr<hittable> object) { objects.push_back(object); }
+    void clear() { objects.clear(); media = false; }
+    void add(shared_ptr<hittable> object) {
+        objects.push_back(object);
+        media = media || object->has_media();
+    }
 
     virtual bool hit(
         const ray& r, double t_min, double t_max, hit_record& rec) const override;
@@ -26,26 +29,52 @@ public:
     virtual double hittable_list::pdf_value(const point3& o, const vec3& v) const override;
     virtual vec3 hittable_list::random(const vec3& o) const override;
 
+    virtual void find_lights(
+        const shared_ptr<hittable>& self, bool flipped, std::vector<light_candidate>& out) const override {
+        for (const auto& object : objects)
+            object->find_lights(object, flipped, out);
+    }
+
+    virtual bool has_media() const override {
+        return media;
+    }
+
+    virtual double transmittance(const ray& r, double t_min, double t_max) const override;
+
 public:
     std::vector<shared_ptr<hittable>> objects;
+
+private:
+    bool media = false;     // whether anything added has media
 };
 
 bool hittable_list::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
-    hit_record temp_rec;
     bool hit_anything = false;
     auto closest_so_far = t_max;
 
+    // Objects only write rec when they report a closer hit, so no temporary is needed.
     for (const auto& object : objects) {
-        if (object->hit(r, t_min, closest_so_far, temp_rec)) {
+        if (object->hit(r, t_min, closest_so_far, rec)) {
             hit_anything = true;
-            closest_so_far = temp_rec.t;
-            rec = temp_rec;
+            closest_so_far = rec.t;
         }
     }
 
     return hit_anything;
 }
 
+double hittable_list::transmittance(const ray& r, double t_min, double t_max) const {
+    auto tr = 1.0;
+    if (!media)
+        return tr;
+
+    for (const auto& object : objects)
+        if (object->has_media())
+            tr *= object->transmittance(r, t_min, t_max);
+
+    return tr;
+}
+
 bool hittable_list::bounding_box(double time0, double time1, aabb& output_box) const {
     if (objects.empty()) return false;
 
@@ -62,6 +91,9 @@ bool hittable_list::bounding_box(double time0, double time1, aabb& output_box) c
 }
 
 double hittable_list::pdf_value(const point3& o, const vec3& v) const {
+    if (objects.empty())
+        return 0;
+
     auto weight = 1.0 / objects.size();
     auto sum = 0.0;
 
@@ -72,6 +104,9 @@ double hittable_list::pdf_value(const point3& o, const vec3& v) const {
 }
 
 vec3 hittable_list::random(const vec3& o) const {
+    if (objects.empty())
+        return vec3(1, 0, 0);
+
     auto int_size = static_cast<int>(objects.size());
     return objects[random_int(0, int_size - 1)]->random(o);
 }
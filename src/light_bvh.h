@@ -0,0 +1,278 @@
+#ifndef LIGHT_BVH_H
+#define LIGHT_BVH_H
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "hittable_list.h"
+#include "light_sampler.h"
+#include "material.h"
+
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+// A BVH over the lights, for scenes with many of them (Conty Estevez and Kulla,
+// "Importance Sampling of Many Lights with Adaptive Tree Splitting"). Each node
+// bounds its lights' positions, total power and emission directions, the latter as
+// a cone of normals. A light is picked by walking down from the root, choosing each
+// child in proportion to an estimate of how much it can contribute at the shading
+// point, so sampling and its pmf are logarithmic in the number of lights.
+class light_bvh : public light_sampler {
+public:
+    // A light that emits in every direction.
+    void add(shared_ptr<hittable> light, const color& radiance) {
+        add(light, luminance(radiance) * light->surface_area(), vec3(0, 0, 1), -1);
+    }
+
+    // A light whose emitting surface faces within acos(cos_theta) of axis.
+    void add(shared_ptr<hittable> light, double power, const vec3& axis, double cos_theta) {
+        add_light(light);
+        light_bounds b;
+        if (!light->bounding_box(0, 1, b.box))
+            b.box = aabb(point3(0, 0, 0), point3(0, 0, 0));
+        b.power = power;
+        b.axis = unit_vector(axis);
+        b.theta_o = acos(clamp(cos_theta, -1.0, 1.0));
+        bounds.push_back(b);
+    }
+
+    // Call after the last add().
+    void build();
+
+    virtual int sample(const point3& p, double u, double& pmf) const override;
+    virtual double pmf(const point3& p, int light) const override;
+
+public:
+    struct light_bounds {
+        aabb box;
+        double power = 0;
+        vec3 axis;
+        double theta_o = pi;    // half-angle of the cone of emission directions
+    };
+
+    struct node {
+        light_bounds bounds;
+        int left = -1;
+        int right = -1;
+        int parent = -1;
+        int light = -1;         // for leaves
+    };
+
+    std::vector<light_bounds> bounds;
+    std::vector<node> nodes;
+
+private:
+    int build_recursive(std::vector<int>& order, size_t start, size_t end, int parent);
+
+    // How much a node's lights could contribute at p: power over squared distance,
+    // scaled by the cosine of the smallest angle between the direction to p and the
+    // cone of emission directions. Zero when p is behind every light in the node.
+    static double importance(const light_bounds& b, const point3& p);
+
+    static light_bounds merge(const light_bounds& a, const light_bounds& b);
+
+    std::vector<int> leaf_of;
+};
+
+light_bvh::light_bounds light_bvh::merge(const light_bounds& a, const light_bounds& b) {
+    light_bounds m;
+    m.box = surrounding_box(a.box, b.box);
+    m.power = a.power + b.power;
+
+    if (a.power <= 0)
+        m.axis = b.axis, m.theta_o = b.theta_o;
+    else if (b.power <= 0)
+        m.axis = a.axis, m.theta_o = a.theta_o;
+    else {
+        // Smallest cone containing both cones.
+        const light_bounds& wide = a.theta_o >= b.theta_o ? a : b;
+        const light_bounds& narrow = a.theta_o >= b.theta_o ? b : a;
+        auto theta_d = acos(clamp(dot(wide.axis, narrow.axis), -1.0, 1.0));
+        if (fmin(theta_d + narrow.theta_o, pi) <= wide.theta_o) {
+            m.axis = wide.axis;
+            m.theta_o = wide.theta_o;
+        }
+        else {
+            auto theta_o = 0.5 * (wide.theta_o + theta_d + narrow.theta_o);
+            if (theta_o >= pi) {
+                m.axis = wide.axis;
+                m.theta_o = pi;
+            }
+            else {
+                // Rotate the wide axis towards the narrow one by theta_o - wide.theta_o.
+                auto theta_r = theta_o - wide.theta_o;
+                auto ortho = narrow.axis - dot(narrow.axis, wide.axis) * wide.axis;
+                if (ortho.length_squared() < 1e-20) {
+                    m.axis = wide.axis;
+                    m.theta_o = pi;
+                }
+                else {
+                    m.axis = unit_vector(cos(theta_r) * wide.axis + sin(theta_r) * unit_vector(ortho));
+                    m.theta_o = theta_o;
+                }
+            }
+        }
+    }
+    return m;
+}
+
+double light_bvh::importance(const light_bounds& b, const point3& p) {
+    if (b.power <= 0)
+        return 0;
+
+    auto center = 0.5 * (b.box.min() + b.box.max());
+    auto radius_squared = 0.25 * (b.box.max() - b.box.min()).length_squared();
+    auto to_p = p - center;
+    auto d2 = fmax(to_p.length_squared(), radius_squared);
+    if (d2 <= 0)
+        return b.power;
+
+    // A full cone can't rule anything out.
+    if (b.theta_o >= pi)
+        return b.power / d2;
+
+    auto cos_theta_w = dot(b.axis, to_p) / sqrt(to_p.length_squared() > 0 ? to_p.length_squared() : 1);
+    auto theta_w = acos(clamp(cos_theta_w, -1.0, 1.0));
+
+    // Angle the box subtends from p; everything is possible from inside it.
+    auto theta_b = pi;
+    if (to_p.length_squared() > radius_squared)
+        theta_b = asin(sqrt(radius_squared / to_p.length_squared()));
+
+    auto theta = fmax(0.0, theta_w - b.theta_o - theta_b);
+    if (theta >= pi / 2)
+        return 0;
+    return b.power * cos(theta) / d2;
+}
+
+void light_bvh::build() {
+    nodes.clear();
+    leaf_of.assign(bounds.size(), -1);
+    if (bounds.empty())
+        return;
+
+    std::vector<int> order(bounds.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = static_cast<int>(i);
+    nodes.reserve(2 * bounds.size());
+    build_recursive(order, 0, order.size(), -1);
+}
+
+int light_bvh::build_recursive(std::vector<int>& order, size_t start, size_t end, int parent) {
+    int index = static_cast<int>(nodes.size());
+    nodes.push_back(node());
+    nodes[index].parent = parent;
+
+    if (end - start == 1) {
+        int light = order[start];
+        nodes[index].bounds = bounds[light];
+        nodes[index].light = light;
+        leaf_of[light] = index;
+        return index;
+    }
+
+    point3 cmin(infinity, infinity, infinity), cmax(-infinity, -infinity, -infinity);
+    for (size_t i = start; i < end; i++) {
+        const auto& box = bounds[order[i]].box;
+        for (int a = 0; a < 3; a++) {
+            auto c = 0.5 * (box.min()[a] + box.max()[a]);
+            cmin[a] = fmin(cmin[a], c);
+            cmax[a] = fmax(cmax[a], c);
+        }
+    }
+    int axis = 0;
+    for (int a = 1; a < 3; a++)
+        if (cmax[a] - cmin[a] > cmax[axis] - cmin[axis])
+            axis = a;
+
+    auto mid = start + (end - start) / 2;
+    std::nth_element(order.begin() + start, order.begin() + mid, order.begin() + end,
+        [&](int a, int b) {
+            return bounds[a].box.min()[axis] + bounds[a].box.max()[axis]
+                < bounds[b].box.min()[axis] + bounds[b].box.max()[axis];
+        });
+
+    int left = build_recursive(order, start, mid, index);
+    int right = build_recursive(order, mid, end, index);
+    nodes[index].left = left;
+    nodes[index].right = right;
+    nodes[index].bounds = merge(nodes[left].bounds, nodes[right].bounds);
+    return index;
+}
+
+int light_bvh::sample(const point3& p, double u, double& pmf) const {
+    pmf = 0;
+    if (nodes.empty())
+        return -1;
+
+    auto probability = 1.0;
+    int index = 0;
+    while (nodes[index].light < 0) {
+        const node& n = nodes[index];
+        auto left = importance(nodes[n.left].bounds, p);
+        auto right = importance(nodes[n.right].bounds, p);
+        if (left + right <= 0)
+            return -1;
+
+        // Reuse u for the next choice by rescaling it into the chosen interval.
+        auto p_left = left / (left + right);
+        if (u < p_left) {
+            u = fmin(u / p_left, 0.99999999);
+            probability *= p_left;
+            index = n.left;
+        }
+        else {
+            u = fmin((u - p_left) / (1 - p_left), 0.99999999);
+            probability *= 1 - p_left;
+            index = n.right;
+        }
+    }
+
+    pmf = probability;
+    return nodes[index].light;
+}
+
+double light_bvh::pmf(const point3& p, int light) const {
+    if (light < 0 || light >= static_cast<int>(leaf_of.size()) || leaf_of[light] < 0)
+        return 0;
+
+    auto probability = 1.0;
+    int index = leaf_of[light];
+    while (nodes[index].parent >= 0) {
+        const node& parent = nodes[nodes[index].parent];
+        auto left = importance(nodes[parent.left].bounds, p);
+        auto right = importance(nodes[parent.right].bounds, p);
+        if (left + right <= 0)
+            return 0;
+        probability *= (parent.left == index ? left : right) / (left + right);
+        index = nodes[index].parent;
+    }
+    return probability;
+}
+
+// Compiles the lights of a scene: every primitive in world whose material emits
+// becomes a light, with its power and emission cone, so the lights can't drift from
+// the geometry. Lights are told apart by primitive, so one placed more than once,
+// directly or under a transform, can't be; it is left to scattered rays.
+shared_ptr<light_bvh> build_light_bvh(const hittable_list& world) {
+    std::vector<light_candidate> candidates;
+    world.find_lights(nullptr, false, candidates);
+
+    std::unordered_map<const hittable*, int> placements;
+    for (const auto& c : candidates)
+        placements[c.object->light_primitive()]++;
+
+    auto lights = make_shared<light_bvh>();
+    for (const auto& c : candidates) {
+        if (!c.mat || placements[c.object->light_primitive()] > 1)
+            continue;
+        auto power = luminance(c.mat->emission()) * c.object->surface_area();
+        if (power > 0)
+            lights->add(c.object, power, c.axis, c.cos_theta);
+    }
+    lights->build();
+    return lights;
+}
+
+#endif
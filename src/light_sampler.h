@@ -0,0 +1,98 @@
+#ifndef LIGHT_SAMPLER_H
+#define LIGHT_SAMPLER_H
+
+#include "rtweekend.h"
+
+#include "alias_table.h"
+#include "hittable.h"
+
+#include <unordered_map>
+#include <vector>
+
+inline double luminance(const color& c) {
+    return 0.2126 * c.x() + 0.7152 * c.y() + 0.0722 * c.z();
+}
+
+// Chooses which light to sample from a shading point. Lights are the emitting
+// primitives themselves, the same objects that are in the world, or world-space views
+// of the ones under transforms. Either way they are indexed by the primitive, so a
+// hit record's obj tells which light a ray found and the two sampling strategies can
+// be weighted against each other.
+class light_sampler {
+public:
+    virtual ~light_sampler() {}
+
+    // Picks a light for shading point p from u in [0, 1); -1 when there are none. pmf
+    // is the probability the light was picked with.
+    virtual int sample(const point3& p, double u, double& pmf) const = 0;
+
+    // Probability that sample() picks the given light at p.
+    virtual double pmf(const point3& p, int light) const = 0;
+
+    size_t size() const { return lights.size(); }
+    const hittable& light(int i) const { return *lights[i]; }
+
+    // The index of the light that recorded a hit, or -1 if it isn't a light.
+    int light_index(const hittable* object) const {
+        auto found = index.find(object);
+        return found == index.end() ? -1 : found->second;
+    }
+
+    // Solid-angle density with which sampling the lights from p produces direction v
+    // towards the given light.
+    double pdf_value(const point3& p, const vec3& v, int light_index) const {
+        return pmf(p, light_index) * lights[light_index]->pdf_value(p, v);
+    }
+
+protected:
+    int add_light(shared_ptr<hittable> light) {
+        int i = static_cast<int>(lights.size());
+        lights.push_back(light);
+        index[light->light_primitive()] = i;
+        return i;
+    }
+
+    std::vector<shared_ptr<hittable>> lights;
+    std::unordered_map<const hittable*, int> index;
+};
+
+// Picks lights in proportion to their emitted power through an alias table, so both
+// picking and the pmf are O(1) however many lights there are.
+class light_list : public light_sampler {
+public:
+    // radiance is what the light emits, power is taken as its luminance times the
+    // light's surface area.
+    void add(shared_ptr<hittable> light, const color& radiance) {
+        add(light, luminance(radiance) * light->surface_area());
+    }
+
+    void add(shared_ptr<hittable> light, double power) {
+        add_light(light);
+        powers.push_back(power);
+    }
+
+    // Call after the last add().
+    void build() { table.build(powers); }
+
+    virtual int sample(const point3& p, double u, double& pmf) const override {
+        if (table.empty()) {
+            pmf = 0;
+            return -1;
+        }
+        int i = table.sample(u);
+        pmf = table.pmf(i);
+        return i;
+    }
+
+    virtual double pmf(const point3& p, int light) const override {
+        return table.pmf(light);
+    }
+
+public:
+    std::vector<double> powers;
+
+private:
+    alias_table table;
+};
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef LOD_MESH_H
+#define LOD_MESH_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "triangle_mesh.h"
+
+#include <vector>
+
+// A mesh with precomputed levels of detail, finest first. Each ray traces exactly one
+// level, the coarsest whose edges are no longer than the ray cone's footprint where
+// it reaches the mesh. The choice is made once per ray for the whole mesh, so a ray
+// never sees a mix of levels, and a ray leaving a level of this mesh keeps using that
+// level so it cannot hit the neighbouring surface of a different level.
+class lod_mesh : public hittable {
+public:
+    lod_mesh(std::vector<shared_ptr<triangle_mesh>> _levels, double scale = 1.0)
+        : levels(std::move(_levels)), lod_scale(scale)
+    {
+        levels[0]->bounding_box(0, 0, box);
+        for (size_t i = 1; i < levels.size(); i++) {
+            aabb level_box;
+            if (levels[i]->bounding_box(0, 0, level_box))
+                box = surrounding_box(box, level_box);
+        }
+        center = 0.5 * (box.min() + box.max());
+        radius = 0.5 * (box.max() - box.min()).length();
+    }
+
+    // Builds coarser levels from a full-resolution mesh by repeated vertex clustering,
+    // doubling the cell size each time.
+    static shared_ptr<lod_mesh> from_mesh(shared_ptr<triangle_mesh> mesh, int level_count, double scale = 1.0);
+
+    size_t select_level(const ray& r) const;
+
+    virtual bool hit(
+        const ray& r, double t_min, double t_max, hit_record& rec) const override {
+        return levels[select_level(r)]->hit(r, t_min, t_max, rec);
+    }
+
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+        output_box = box;
+        return true;
+    }
+
+public:
+    std::vector<shared_ptr<triangle_mesh>> levels;
+    double lod_scale;
+    aabb box;
+    point3 center;
+    double radius;
+};
+
+size_t lod_mesh::select_level(const ray& r) const {
+    for (size_t i = 0; i < levels.size(); i++)
+        if (r.origin_object == levels[i].get())
+            return i;
+
+    // Footprint at the nearest point of the mesh's bounding sphere.
+    auto distance = fmax(0.0, (center - r.origin()).length() - radius);
+    auto footprint = lod_scale * r.footprint(distance);
+
+    size_t level = 0;
+    while (level + 1 < levels.size() && levels[level + 1]->average_edge_length() <= footprint)
+        level++;
+    return level;
+}
+
+shared_ptr<lod_mesh> lod_mesh::from_mesh(shared_ptr<triangle_mesh> mesh, int level_count, double scale) {
+    std::vector<shared_ptr<triangle_mesh>> levels{ mesh };
+    auto cell_size = 2 * mesh->average_edge_length();
+
+    for (int i = 1; i < level_count; i++) {
+        auto coarser = levels.back()->decimated(cell_size);
+        if (coarser->triangle_count() == 0)
+            break;
+        levels.push_back(coarser);
+        cell_size *= 2;
+    }
+
+    return make_shared<lod_mesh>(levels, scale);
+}
+
+#endif
@@ -108,6 +108,9 @@ int main(int argc, char* argv[]) {
 
 		ImGui::InputInt2("size", inputSize);
 		ImGui::InputInt("samples", &samples_per_pixel);
+		ImGui::Checkbox("adaptive", &adaptive_sampling);
+		ImGui::InputFloat("noise tolerance", &adaptive_tolerance, 0.001f, 0.01f, "%.4f");
+		ImGui::Combo("sampler", (int*)&pixel_sampler, "independent\0halton\0sobol\0");
 		ImGui::Separator();
 		InputDouble3("lookfrom", (double*)&lookfrom);
 		InputDouble3("lookat", (double*)&lookat);
@@ -116,6 +119,10 @@ int main(int argc, char* argv[]) {
 		ImGui::InputFloat("focus distance", &dist_to_focus);
 		if (ImGui::Button("render"))
 		{
+			// A progressive render may still be writing to the old buffer.
+			rt.stop();
+			rt.wait();
+
 			image_width = inputSize[0];
 			image_height = inputSize[1];
 
@@ -130,6 +137,10 @@ int main(int argc, char* argv[]) {
 		ImGui::SameLine();
 		if (ImGui::Button("render sync"))
 		{
+			// A progressive render may still be writing to the old buffer.
+			rt.stop();
+			rt.wait();
+
 			image_width = inputSize[0];
 			image_height = inputSize[1];
 
@@ -141,6 +152,11 @@ int main(int argc, char* argv[]) {
 
 			showResult = true;
 		}
+		ImGui::SameLine();
+		if (ImGui::Button("stop"))
+		{
+			rt.stop();
+		}
 		ImGui::End();
 
 		if (showResult)
@@ -170,6 +186,11 @@ int main(int argc, char* argv[]) {
 		glfwPollEvents();
 	}
 
+	// Workers must be done with the film and the pixels before they are destroyed.
+	rt.stop();
+	rt.wait();
+	delete[] pixels;
+
 	ImGui_ImplOpenGL3_Shutdown();
 	ImGui_ImplGlfw_Shutdown();
 	ImGui::DestroyContext();
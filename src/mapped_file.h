@@ -0,0 +1,139 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <iostream>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A read-only memory mapping of a file, or of a range of it. Pages are brought in by
+// the OS on first touch, so only the parts of the file that are actually read use
+// physical memory.
+class mapped_file {
+public:
+    mapped_file() {}
+
+    mapped_file(const char* filename) {
+        open(filename);
+    }
+
+    ~mapped_file() {
+        close();
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    bool open(const char* filename);
+
+    // Maps size bytes starting at offset, which must be a multiple of
+    // mapping_granularity.
+    bool open(const char* filename, size_t offset, size_t size);
+    void close();
+
+    // Alignment of range offsets; 64KB is the allocation granularity on Windows and a
+    // multiple of the page size elsewhere.
+    static const size_t mapping_granularity = 65536;
+
+    const unsigned char* data() const { return bytes; }
+    size_t size() const { return length; }
+    bool is_open() const { return bytes != nullptr; }
+
+private:
+    const unsigned char* bytes = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+};
+
+bool mapped_file::open(const char* filename) {
+    return open(filename, 0, 0);
+}
+
+bool mapped_file::open(const char* filename, size_t offset, size_t size) {
+    close();
+
+#ifdef _WIN32
+    file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr,
+        OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        std::cerr << "ERROR: Could not open file '" << filename << "'.\n";
+        return false;
+    }
+
+    LARGE_INTEGER file_size;
+    GetFileSizeEx(file, &file_size);
+    auto total = static_cast<size_t>(file_size.QuadPart);
+    if (offset < total) {
+        length = size != 0 ? size : total - offset;
+        if (length <= total - offset)
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    }
+    if (mapping != nullptr) {
+        auto high = static_cast<DWORD>(static_cast<unsigned long long>(offset) >> 32);
+        auto low = static_cast<DWORD>(offset & 0xffffffff);
+        bytes = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, high, low, length));
+    }
+#else
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0) {
+        std::cerr << "ERROR: Could not open file '" << filename << "'.\n";
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) > offset) {
+        auto total = static_cast<size_t>(st.st_size);
+        length = size != 0 ? size : total - offset;
+        if (length <= total - offset) {
+            void* p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, static_cast<off_t>(offset));
+            if (p != MAP_FAILED)
+                bytes = static_cast<const unsigned char*>(p);
+        }
+    }
+    ::close(fd);
+#endif
+
+    if (bytes == nullptr) {
+        std::cerr << "ERROR: Could not map file '" << filename << "'.\n";
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+void mapped_file::close() {
+#ifdef _WIN32
+    if (bytes != nullptr)
+        UnmapViewOfFile(bytes);
+    if (mapping != nullptr)
+        CloseHandle(mapping);
+    if (file != INVALID_HANDLE_VALUE)
+        CloseHandle(file);
+    mapping = nullptr;
+    file = INVALID_HANDLE_VALUE;
+#else
+    if (bytes != nullptr)
+        munmap(const_cast<unsigned char*>(bytes), length);
+#endif
+    bytes = nullptr;
+    length = 0;
+}
+
+#endif
@@ -12,7 +12,7 @@ struct scatter_record {
     ray specular_ray;
     bool is_specular;
     color attenuation;
-    shared_ptr<pdf> pdf_ptr;
+    scatter_pdf sampling_pdf;
 };
 
 class material {
@@ -34,6 +34,12 @@ public:
         const point3& p) const {
         return color(0, 0, 0);
     }
+
+    // Typical radiance leaving the front face, zero for materials that don't emit.
+    // Used to find the lights in a scene and estimate their power.
+    virtual color emission() const {
+        return color(0, 0, 0);
+    }
 };
 
 class lambertian : public material {
@@ -46,7 +52,7 @@ public:
     ) const override {
         srec.is_specular = false;
         srec.attenuation = albedo->value(rec.u, rec.v, rec.p);
-        srec.pdf_ptr = make_shared<cosine_pdf>(rec.normal);
+        srec.sampling_pdf.set_cosine(rec.normal);
         return true;
     }
     double scattering_pdf(
@@ -70,7 +76,7 @@ public:
         srec.specular_ray = ray(rec.p, reflected + fuzz * random_in_unit_sphere());
         srec.attenuation = albedo;
         srec.is_specular = true;
-        srec.pdf_ptr = 0;
+        srec.sampling_pdf.set_none();
         return true;
     }
 public:
@@ -86,7 +92,7 @@ public:
         const ray& r_in, const hit_record& rec, scatter_record& srec
     ) const override {
         srec.is_specular = true;
-        srec.pdf_ptr = nullptr;
+        srec.sampling_pdf.set_none();
         srec.attenuation = color(1.0, 1.0, 1.0);
         double refraction_ratio = rec.front_face ? (1.0 / ir) : ir;
 
@@ -136,8 +142,36 @@ public:
             return color(0, 0, 0);
     }
 
+    virtual color emission() const override {
+        return emit->value(0.5, 0.5, point3(0, 0, 0));
+    }
+
 public:
     shared_ptr<texture> emit;
 };
 
+class isotropic : public material {
+public:
+    isotropic(color c) : albedo(make_shared<solid_color>(c)) {}
+    isotropic(shared_ptr<texture> a) : albedo(a) {}
+
+    virtual bool scatter(
+        const ray& r_in, const hit_record& rec, scatter_record& srec
+    ) const override {
+        srec.is_specular = false;
+        srec.attenuation = albedo->value(rec.u, rec.v, rec.p);
+        srec.sampling_pdf.set_sphere();
+        return true;
+    }
+
+    virtual double scattering_pdf(
+        const ray& r_in, const hit_record& rec, const ray& scattered
+    ) const override {
+        return 1 / (4 * pi);
+    }
+
+public:
+    shared_ptr<texture> albedo;
+};
+
 #endif
\ No newline at end of file
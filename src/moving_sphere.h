@@ -17,6 +17,8 @@ public:
         const ray& r, double t_min, double t_max, hit_record& rec) const override;
     virtual bool bounding_box(
         double _time0, double _time1, aabb& output_box) const override;
+    virtual void compute_surface_interaction(const ray& r, hit_record& rec) const override;
+    virtual bool hit_interval(const ray& r, double& t_enter, double& t_exit) const override;
 
     point3 center(double time) const;
 
@@ -49,12 +51,29 @@ bool moving_sphere::hit(const ray& r, double t_min, double t_max, hit_record& re
             return false;
     }
 
-    rec.t = root;
+    rec.set_deferred(this, root);
+    return true;
+}
+
+void moving_sphere::compute_surface_interaction(const ray& r, hit_record& rec) const {
     rec.p = r.at(rec.t);
     auto outward_normal = (rec.p - center(r.time())) / radius;
     rec.set_face_normal(r, outward_normal);
-    rec.mat_ptr = mat_ptr;
+    rec.mat_ptr = mat_ptr.get();
+}
+
+bool moving_sphere::hit_interval(const ray& r, double& t_enter, double& t_exit) const {
+    vec3 oc = r.origin() - center(r.time());
+    auto a = r.direction().length_squared();
+    auto half_b = dot(oc, r.direction());
+    auto c = oc.length_squared() - radius * radius;
+
+    auto discriminant = half_b * half_b - a * c;
+    if (discriminant <= 0) return false;
+    auto sqrtd = sqrt(discriminant);
 
+    t_enter = (-half_b - sqrtd) / a;
+    t_exit = (-half_b + sqrtd) / a;
     return true;
 }
 
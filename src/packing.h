@@ -0,0 +1,110 @@
+#ifndef PACKING_H
+#define PACKING_H
+
+#include "rtweekend.h"
+
+#include <cstdint>
+#include <cstring>
+
+// Compact encodings for vertex attributes.
+
+// Octahedral encoding of a unit vector into two 16-bit snorm values packed in 32 bits
+// (Cigolle et al., "A Survey of Efficient Representations for Independent Unit
+// Vectors"). The error is well below 0.01 degrees.
+inline uint32_t oct_encode(const vec3& n) {
+    auto l1 = fabs(n.x()) + fabs(n.y()) + fabs(n.z());
+    auto x = n.x() / l1;
+    auto y = n.y() / l1;
+    if (n.z() < 0) {
+        auto ox = (1 - fabs(y)) * (x >= 0 ? 1 : -1);
+        auto oy = (1 - fabs(x)) * (y >= 0 ? 1 : -1);
+        x = ox;
+        y = oy;
+    }
+
+    auto to_snorm = [](double v) {
+        return static_cast<uint32_t>(static_cast<int16_t>(floor(clamp(v, -1.0, 1.0) * 32767 + 0.5))) & 0xffff;
+    };
+    return to_snorm(x) | (to_snorm(y) << 16);
+}
+
+inline vec3 oct_decode(uint32_t packed) {
+    auto x = static_cast<int16_t>(packed & 0xffff) / 32767.0;
+    auto y = static_cast<int16_t>(packed >> 16) / 32767.0;
+    auto z = 1 - fabs(x) - fabs(y);
+    if (z < 0) {
+        auto ox = (1 - fabs(y)) * (x >= 0 ? 1 : -1);
+        auto oy = (1 - fabs(x)) * (y >= 0 ? 1 : -1);
+        x = ox;
+        y = oy;
+    }
+    return unit_vector(vec3(x, y, z));
+}
+
+// IEEE 754 half precision, round to nearest even. Overflow becomes infinity and
+// values below the half range flush to zero.
+inline uint16_t float_to_half(float f) {
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+
+    uint32_t sign = (bits >> 16) & 0x8000;
+    int32_t exponent = static_cast<int32_t>((bits >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = bits & 0x7fffff;
+
+    if (((bits >> 23) & 0xff) == 0xff)
+        return static_cast<uint16_t>(sign | 0x7c00 | (mantissa ? 0x200 : 0));
+    if (exponent >= 31)
+        return static_cast<uint16_t>(sign | 0x7c00);
+    if (exponent <= 0) {
+        if (exponent < -10)
+            return static_cast<uint16_t>(sign);
+        mantissa |= 0x800000;
+        uint32_t shift = 14 - exponent;
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t midpoint = 1u << (shift - 1);
+        if (rest > midpoint || (rest == midpoint && (half & 1)))
+            half++;
+        return static_cast<uint16_t>(sign | half);
+    }
+
+    uint32_t half = (static_cast<uint32_t>(exponent) << 10) | (mantissa >> 13);
+    uint32_t rest = mantissa & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1)))
+        half++;
+    return static_cast<uint16_t>(sign | half);
+}
+
+inline float half_to_float(uint16_t h) {
+    uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+    uint32_t exponent = (h >> 10) & 0x1f;
+    uint32_t mantissa = h & 0x3ff;
+    uint32_t bits;
+
+    if (exponent == 0) {
+        if (mantissa == 0) {
+            bits = sign;
+        }
+        else {
+            // Subnormal half: renormalize.
+            exponent = 127 - 15 + 1;
+            while (!(mantissa & 0x400)) {
+                mantissa <<= 1;
+                exponent--;
+            }
+            bits = sign | (exponent << 23) | ((mantissa & 0x3ff) << 13);
+        }
+    }
+    else if (exponent == 31) {
+        bits = sign | 0x7f800000 | (mantissa << 13);
+    }
+    else {
+        bits = sign | ((exponent - 15 + 127) << 23) | (mantissa << 13);
+    }
+
+    float f;
+    std::memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+#endif
@@ -0,0 +1,443 @@
+#ifndef PAGED_SCENE_H
+#define PAGED_SCENE_H
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "geometry_cache.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "mapped_file.h"
+#include "triangle_mesh.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// Triangle geometry kept on disk in spatially coherent chunks, for scenes that don't
+// fit in memory. A chunk is mapped and turned into a (compressed) triangle_mesh when
+// a ray first reaches its bounds, and lives in a geometry_cache whose budget bounds
+// the resident memory.
+//
+// File layout: a file_header, chunk_count chunk_entry records, then each chunk's
+// float positions and int32 indices at an offset aligned for mapping.
+class paged_scene : public hittable {
+public:
+    static const uint32_t file_magic = 0x4b4e4843;  // "CHNK"
+    static const uint32_t file_version = 1;
+
+    struct file_header {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t chunk_count;
+        uint32_t padding;
+    };
+
+    struct chunk_entry {
+        float bmin[3];
+        float bmax[3];
+        uint64_t offset;
+        uint32_t vertex_count;
+        uint32_t triangle_count;
+        uint32_t material;
+        uint32_t padding;
+    };
+
+    paged_scene(const std::string& file, std::vector<shared_ptr<material>> materials,
+        shared_ptr<geometry_cache> geometry);
+
+    bool is_loaded() const { return !chunks.empty(); }
+
+    // The mesh for chunk c, paged in if it isn't resident. Null if the chunk couldn't
+    // be read; that isn't cached, so the next call tries again.
+    shared_ptr<triangle_mesh> chunk(int c) const;
+
+    // The same, through the calling thread's pins, for single-ray traversal: rays that
+    // stay within recently used chunks find them without locking the cache. Valid for
+    // as long as geometry_cache::get_pinned() says.
+    const triangle_mesh* pinned_chunk(int c) const;
+
+    virtual bool hit(
+        const ray& r, double t_min, double t_max, hit_record& rec) const override {
+        return top_level && top_level->hit(r, t_min, t_max, rec);
+    }
+
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+        return top_level && top_level->bounding_box(time0, time1, output_box);
+    }
+
+    // Closest hits for a batch of rays. Rays are queued on every chunk their path
+    // crosses, found through the top-level BVH, and the queues are drained one chunk
+    // at a time, resident chunks first, so each chunk is paged in at most once per
+    // batch however many rays need it. Records come back with their surface
+    // interaction computed.
+    void hit_queued(const std::vector<ray>& rays, double t_min, double t_max,
+        std::vector<hit_record>& recs, std::vector<char>& hits) const;
+
+public:
+    std::string filename;
+    std::vector<chunk_entry> chunks;
+    std::vector<shared_ptr<material>> materials;
+    shared_ptr<geometry_cache> cache;
+
+private:
+    friend class paged_chunk;
+
+    struct queue_entry {
+        int ray;
+        double t_enter;
+    };
+
+    // Set while hit_queued() walks the top level with one of its rays: the chunks the
+    // ray reaches add it to their queue instead of intersecting it.
+    struct queue_target {
+        std::vector<std::vector<queue_entry>>* queues;
+        int ray;
+    };
+
+    static queue_target*& queuing() {
+        thread_local queue_target* target = nullptr;
+        return target;
+    }
+
+    shared_ptr<triangle_mesh> load_chunk(int c, size_t& bytes) const;
+
+    shared_ptr<hittable> top_level;
+};
+
+// A chunk's bounds in the top-level BVH; the geometry is fetched only on a box hit.
+class paged_chunk : public hittable {
+public:
+    paged_chunk(const paged_scene* s, int c, const aabb& b) : scene(s), index(c), box(b) {}
+
+    virtual bool hit(
+        const ray& r, double t_min, double t_max, hit_record& rec) const override {
+        if (auto target = paged_scene::queuing()) {
+            auto t0 = t_min, t1 = t_max;
+            if (box.clip(r, t0, t1))
+                (*target->queues)[index].push_back({ target->ray, t0 });
+            return false;
+        }
+
+        auto mesh = scene->pinned_chunk(index);
+        if (!mesh || !mesh->hit(r, t_min, t_max, rec))
+            return false;
+
+        // The pin may be dropped before the closest hit is known.
+        rec.compute_surface_interaction(r);
+        return true;
+    }
+
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+        output_box = box;
+        return true;
+    }
+
+public:
+    const paged_scene* scene;
+    int index;
+    aabb box;
+};
+
+paged_scene::paged_scene(const std::string& file, std::vector<shared_ptr<material>> m,
+    shared_ptr<geometry_cache> geometry)
+    : filename(file), materials(std::move(m)), cache(geometry)
+{
+    std::ifstream in(filename, std::ios::binary);
+    file_header header;
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))
+        || header.magic != file_magic || header.version != file_version) {
+        std::cerr << "ERROR: '" << filename << "' is not a chunked scene file.\n";
+        return;
+    }
+
+    chunks.resize(header.chunk_count);
+    if (!in.read(reinterpret_cast<char*>(chunks.data()), chunks.size() * sizeof(chunk_entry))) {
+        std::cerr << "ERROR: Truncated chunk table in '" << filename << "'.\n";
+        chunks.clear();
+        return;
+    }
+
+    // Every chunk must lie within the file at an offset that can be mapped, have
+    // ordered bounds and name one of the materials, so paging it in later can't fail
+    // for anything the table says.
+    in.seekg(0, std::ios::end);
+    auto file_size = static_cast<uint64_t>(in.tellg());
+    for (size_t c = 0; c < chunks.size(); c++) {
+        const auto& e = chunks[c];
+        auto size = 3 * sizeof(float) * uint64_t(e.vertex_count) + 3 * sizeof(int32_t) * uint64_t(e.triangle_count);
+        bool valid = e.offset % mapped_file::mapping_granularity == 0
+            && e.offset <= file_size && size <= file_size - e.offset;
+        for (int a = 0; a < 3; a++)
+            valid = valid && e.bmin[a] <= e.bmax[a];
+        if (!valid) {
+            std::cerr << "ERROR: Chunk table in '" << filename << "' is corrupt.\n";
+            chunks.clear();
+            return;
+        }
+        if (e.material >= materials.size()) {
+            std::cerr << "ERROR: Chunk " << c << " of '" << filename << "' uses material " << e.material
+                << ", but only " << materials.size() << " were given.\n";
+            chunks.clear();
+            return;
+        }
+    }
+
+    hittable_list list;
+    for (size_t c = 0; c < chunks.size(); c++) {
+        const auto& e = chunks[c];
+        list.add(make_shared<paged_chunk>(this, static_cast<int>(c),
+            aabb(point3(e.bmin[0], e.bmin[1], e.bmin[2]), point3(e.bmax[0], e.bmax[1], e.bmax[2]))));
+    }
+    if (!list.objects.empty())
+        top_level = make_shared<bvh_node>(list, 0, 1);
+}
+
+shared_ptr<triangle_mesh> paged_scene::load_chunk(int c, size_t& bytes) const {
+    const auto& e = chunks[c];
+    size_t position_bytes = 3 * sizeof(float) * e.vertex_count;
+    size_t index_bytes = 3 * sizeof(int32_t) * e.triangle_count;
+
+    mapped_file view;
+    std::vector<point3> positions;
+    std::vector<int> indices;
+    if (position_bytes + index_bytes > 0) {
+        // mapped_file reports why.
+        if (!view.open(filename.c_str(), e.offset, position_bytes + index_bytes))
+            return nullptr;
+
+        auto p = reinterpret_cast<const float*>(view.data());
+        positions.reserve(e.vertex_count);
+        for (uint32_t v = 0; v < e.vertex_count; v++)
+            positions.push_back(point3(p[3 * v], p[3 * v + 1], p[3 * v + 2]));
+
+        auto idx = reinterpret_cast<const int32_t*>(view.data() + position_bytes);
+        indices.assign(idx, idx + 3 * e.triangle_count);
+        for (auto i : indices) {
+            if (i < 0 || static_cast<uint32_t>(i) >= e.vertex_count) {
+                std::cerr << "ERROR: Chunk " << c << " of '" << filename << "' has a vertex index out of range.\n";
+                return nullptr;
+            }
+        }
+    }
+
+    auto mesh = make_shared<triangle_mesh>(
+        std::move(positions), std::move(indices), materials[e.material]);
+    mesh->compress();
+    bytes = mesh->memory_size();
+    return mesh;
+}
+
+shared_ptr<triangle_mesh> paged_scene::chunk(int c) const {
+    return std::static_pointer_cast<triangle_mesh>(cache->get(
+        geometry_cache::key{ this, static_cast<size_t>(c) },
+        [&](size_t& bytes) { return std::static_pointer_cast<hittable>(load_chunk(c, bytes)); }));
+}
+
+const triangle_mesh* paged_scene::pinned_chunk(int c) const {
+    return static_cast<const triangle_mesh*>(cache->get_pinned(
+        geometry_cache::key{ this, static_cast<size_t>(c) },
+        [&](size_t& bytes) { return std::static_pointer_cast<hittable>(load_chunk(c, bytes)); }));
+}
+
+void paged_scene::hit_queued(const std::vector<ray>& rays, double t_min, double t_max,
+    std::vector<hit_record>& recs, std::vector<char>& hits) const
+{
+    std::vector<std::vector<queue_entry>> queues(chunks.size());
+    std::vector<double> closest(rays.size(), t_max);
+    recs.resize(rays.size());
+    hits.assign(rays.size(), 0);
+    if (!top_level)
+        return;
+
+    // Nothing is hit while queuing, so the walk visits every chunk the ray reaches.
+    queue_target target{ &queues, 0 };
+    queuing() = &target;
+    for (size_t i = 0; i < rays.size(); i++) {
+        hit_record rec;
+        target.ray = static_cast<int>(i);
+        top_level->hit(rays[i], t_min, t_max, rec);
+    }
+    queuing() = nullptr;
+
+    // Resident chunks first, since they may shorten rays before anything is read from
+    // disk; then the rest, busiest first.
+    std::vector<int> order;
+    for (size_t c = 0; c < chunks.size(); c++)
+        if (!queues[c].empty())
+            order.push_back(static_cast<int>(c));
+    std::vector<char> resident(chunks.size());
+    for (int c : order)
+        resident[c] = cache->contains(geometry_cache::key{ this, static_cast<size_t>(c) });
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+        if (resident[a] != resident[b])
+            return resident[a] > resident[b];
+        return queues[a].size() > queues[b].size();
+    });
+
+    for (int c : order) {
+        shared_ptr<triangle_mesh> mesh;
+        for (const auto& q : queues[c]) {
+            // Skip rays that have already hit something in front of this chunk.
+            if (q.t_enter > closest[q.ray])
+                continue;
+            if (!mesh && !(mesh = chunk(c)))
+                break;
+
+            const auto& r = rays[q.ray];
+            hit_record rec;
+            if (mesh->hit(r, t_min, closest[q.ray], rec)) {
+                rec.compute_surface_interaction(r);
+                closest[q.ray] = rec.t;
+                recs[q.ray] = rec;
+                hits[q.ray] = 1;
+            }
+        }
+    }
+}
+
+// Splits triangle geometry into chunks of at most triangles_per_chunk by recursive
+// median splits on the triangle centroids, and writes them in paged_scene's format.
+// Each add() call's material index applies to all of its triangles; chunks never mix
+// materials.
+class paged_scene_builder {
+public:
+    void add(const std::vector<point3>& positions, const std::vector<int>& indices, uint32_t material);
+
+    bool write(const std::string& filename, size_t triangles_per_chunk = 65536) const;
+
+private:
+    struct triangle {
+        point3 p[3];
+        uint32_t material;
+    };
+
+    void split(std::vector<triangle>& tris, size_t start, size_t end, size_t limit,
+        std::vector<std::pair<size_t, size_t>>& ranges) const;
+
+    std::vector<triangle> triangles;
+};
+
+void paged_scene_builder::add(
+    const std::vector<point3>& positions, const std::vector<int>& indices, uint32_t material)
+{
+    for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+        triangle t;
+        for (int k = 0; k < 3; k++)
+            t.p[k] = positions[indices[i + k]];
+        t.material = material;
+        triangles.push_back(t);
+    }
+}
+
+void paged_scene_builder::split(std::vector<triangle>& tris, size_t start, size_t end, size_t limit,
+    std::vector<std::pair<size_t, size_t>>& ranges) const
+{
+    if (end - start <= limit) {
+        ranges.push_back({ start, end });
+        return;
+    }
+
+    point3 cmin(infinity, infinity, infinity), cmax(-infinity, -infinity, -infinity);
+    for (size_t i = start; i < end; i++) {
+        for (int a = 0; a < 3; a++) {
+            auto c = tris[i].p[0][a] + tris[i].p[1][a] + tris[i].p[2][a];
+            cmin[a] = fmin(cmin[a], c);
+            cmax[a] = fmax(cmax[a], c);
+        }
+    }
+    int axis = 0;
+    for (int a = 1; a < 3; a++)
+        if (cmax[a] - cmin[a] > cmax[axis] - cmin[axis])
+            axis = a;
+
+    auto mid = start + (end - start) / 2;
+    std::nth_element(tris.begin() + start, tris.begin() + mid, tris.begin() + end,
+        [axis](const triangle& a, const triangle& b) {
+            return a.p[0][axis] + a.p[1][axis] + a.p[2][axis] < b.p[0][axis] + b.p[1][axis] + b.p[2][axis];
+        });
+    split(tris, start, mid, limit, ranges);
+    split(tris, mid, end, limit, ranges);
+}
+
+bool paged_scene_builder::write(const std::string& filename, size_t triangles_per_chunk) const {
+    auto tris = triangles;
+    std::sort(tris.begin(), tris.end(),
+        [](const triangle& a, const triangle& b) { return a.material < b.material; });
+
+    std::vector<std::pair<size_t, size_t>> ranges;
+    for (size_t start = 0; start < tris.size();) {
+        auto end = start;
+        while (end < tris.size() && tris[end].material == tris[start].material)
+            end++;
+        split(tris, start, end, std::max<size_t>(triangles_per_chunk, 1), ranges);
+        start = end;
+    }
+
+    std::ofstream out(filename, std::ios::binary);
+    if (!out) {
+        std::cerr << "ERROR: Could not write '" << filename << "'.\n";
+        return false;
+    }
+
+    auto align = [](uint64_t offset) {
+        auto g = static_cast<uint64_t>(mapped_file::mapping_granularity);
+        return (offset + g - 1) / g * g;
+    };
+
+    // Vertices are welded within a chunk only, so chunks are independent on disk. The
+    // table is written last, once every chunk's size is known.
+    std::vector<paged_scene::chunk_entry> entries(ranges.size());
+    uint64_t offset = align(sizeof(paged_scene::file_header) + entries.size() * sizeof(paged_scene::chunk_entry));
+    for (size_t c = 0; c < ranges.size(); c++) {
+        auto& e = entries[c];
+        std::vector<float> positions;
+        std::vector<int32_t> indices;
+        std::map<std::tuple<float, float, float>, int32_t> welded;
+        for (int a = 0; a < 3; a++) {
+            e.bmin[a] = HUGE_VALF;
+            e.bmax[a] = -HUGE_VALF;
+        }
+        for (size_t i = ranges[c].first; i < ranges[c].second; i++) {
+            for (int k = 0; k < 3; k++) {
+                float p[3];
+                for (int a = 0; a < 3; a++) {
+                    p[a] = static_cast<float>(tris[i].p[k][a]);
+                    e.bmin[a] = std::min(e.bmin[a], std::nextafterf(p[a], -HUGE_VALF));
+                    e.bmax[a] = std::max(e.bmax[a], std::nextafterf(p[a], HUGE_VALF));
+                }
+                auto key = std::make_tuple(p[0], p[1], p[2]);
+                auto found = welded.find(key);
+                if (found == welded.end()) {
+                    found = welded.emplace(key, static_cast<int32_t>(positions.size() / 3)).first;
+                    positions.insert(positions.end(), p, p + 3);
+                }
+                indices.push_back(found->second);
+            }
+        }
+        e.offset = offset;
+        e.vertex_count = static_cast<uint32_t>(positions.size() / 3);
+        e.triangle_count = static_cast<uint32_t>(indices.size() / 3);
+        e.material = tris[ranges[c].first].material;
+        e.padding = 0;
+
+        out.seekp(static_cast<std::streamoff>(offset));
+        out.write(reinterpret_cast<const char*>(positions.data()), positions.size() * sizeof(float));
+        out.write(reinterpret_cast<const char*>(indices.data()), indices.size() * sizeof(int32_t));
+        offset = align(offset + positions.size() * sizeof(float) + indices.size() * sizeof(int32_t));
+    }
+
+    paged_scene::file_header header{ paged_scene::file_magic, paged_scene::file_version,
+        static_cast<uint32_t>(entries.size()), 0 };
+    out.seekp(0);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(paged_scene::chunk_entry));
+
+    return static_cast<bool>(out);
+}
+
+#endif
@@ -3,6 +3,14 @@
 
 #include "vec3.h"
 
+// Weight for a sample drawn with density f_pdf when another strategy could have drawn
+// it with density g_pdf (Veach's power heuristic, beta = 2).
+inline double power_heuristic(double f_pdf, double g_pdf) {
+    auto f = f_pdf * f_pdf;
+    auto g = g_pdf * g_pdf;
+    return f + g > 0 ? f / (f + g) : 0;
+}
+
 class pdf {
 public:
     virtual ~pdf() {}
@@ -13,6 +21,7 @@ public:
 
 class cosine_pdf : public pdf {
 public:
+    cosine_pdf() {}
     cosine_pdf(const vec3& w) { uvw.build_from_w(w); }
 
     virtual double value(const vec3& direction) const override {
@@ -28,9 +37,24 @@ public:
     onb uvw;
 };
 
+class sphere_pdf : public pdf {
+public:
+    sphere_pdf() {}
+
+    virtual double value(const vec3& direction) const override {
+        return 1 / (4 * pi);
+    }
+
+    virtual vec3 generate() const override {
+        return random_unit_vector();
+    }
+};
+
+// The pdfs below only refer to what they combine; they are meant to live on the
+// stack for one bounce.
 class hittable_pdf : public pdf {
 public:
-    hittable_pdf(shared_ptr<hittable> p, const point3& origin) : ptr(p), o(origin) {}
+    hittable_pdf(const hittable& p, const point3& origin) : ptr(&p), o(origin) {}
 
     virtual double value(const vec3& direction) const override {
         return ptr->pdf_value(o, direction);
@@ -42,14 +66,14 @@ public:
 
 public:
     point3 o;
-    shared_ptr<hittable> ptr;
+    const hittable* ptr;
 };
 
 class mixture_pdf : public pdf {
 public:
-    mixture_pdf(shared_ptr<pdf> p0, shared_ptr<pdf> p1) {
-        p[0] = p0;
-        p[1] = p1;
+    mixture_pdf(const pdf& p0, const pdf& p1) {
+        p[0] = &p0;
+        p[1] = &p1;
     }
 
     virtual double value(const vec3& direction) const override {
@@ -64,7 +88,44 @@ public:
     }
 
 public:
-    shared_ptr<pdf> p[2];
+    const pdf* p[2];
+};
+
+// The distribution a material scatters with, held by value in scatter_record so a
+// bounce doesn't allocate. Covers every distribution the materials use.
+class scatter_pdf : public pdf {
+public:
+    enum class kind { none, cosine, sphere };
+
+    void set_none() { type = kind::none; }
+
+    void set_cosine(const vec3& w) {
+        type = kind::cosine;
+        cosine.uvw.build_from_w(w);
+    }
+
+    void set_sphere() { type = kind::sphere; }
+
+    virtual double value(const vec3& direction) const override {
+        switch (type) {
+        case kind::cosine: return cosine.value(direction);
+        case kind::sphere: return sphere.value(direction);
+        default: return 0;
+        }
+    }
+
+    virtual vec3 generate() const override {
+        switch (type) {
+        case kind::cosine: return cosine.generate();
+        case kind::sphere: return sphere.generate();
+        default: return vec3(1, 0, 0);
+        }
+    }
+
+public:
+    kind type = kind::none;
+    cosine_pdf cosine;
+    sphere_pdf sphere;
 };
 
 #endif
\ No newline at end of file
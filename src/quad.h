@@ -0,0 +1,136 @@
+#ifndef QUAD_H
+#define QUAD_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+
+// A parallelogram with corner Q and edge vectors u and v, in any orientation. The
+// plane (normal, D) and the vector w used to find the planar coordinates of a hit are
+// precomputed, so both hit() and pdf_value() are a dot product plus two cross products.
+class quad : public hittable {
+public:
+    quad() {}
+
+    quad(const point3& _Q, const vec3& _u, const vec3& _v, shared_ptr<material> mat)
+        : Q(_Q), u(_u), v(_v), mp(mat)
+    {
+        auto n = cross(u, v);
+        normal = unit_vector(n);
+        D = dot(normal, Q);
+        w = n / dot(n, n);
+        area = n.length();
+    }
+
+    virtual bool hit(const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual void compute_surface_interaction(const ray& r, hit_record& rec) const override;
+
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+
+    virtual double pdf_value(const point3& origin, const vec3& direction) const override;
+    virtual vec3 random(const point3& origin) const override;
+
+    virtual double surface_area() const override {
+        return area;
+    }
+
+    virtual void find_lights(
+        const shared_ptr<hittable>& self, bool flipped, std::vector<light_candidate>& out) const override {
+        out.push_back({ self, mp.get(), flipped ? -normal : normal, 1 });
+    }
+
+public:
+    point3 Q;
+    vec3 u, v;
+    shared_ptr<material> mp;
+    vec3 normal;
+    double D;
+    vec3 w;
+    double area;
+
+private:
+    // Intersects the line with the plane and returns the planar coordinates of the
+    // crossing point; true if it lies inside the parallelogram and within [t_min, t_max].
+    bool intersect(const ray& r, double t_min, double t_max, double& t, double& alpha, double& beta) const {
+        auto denom = dot(normal, r.direction());
+
+        // No hit if the ray is parallel to the plane.
+        if (fabs(denom) < 1e-8)
+            return false;
+
+        t = (D - dot(normal, r.origin())) / denom;
+        if (t < t_min || t > t_max)
+            return false;
+
+        auto planar_hitpt_vector = r.at(t) - Q;
+        alpha = dot(w, cross(planar_hitpt_vector, v));
+        beta = dot(w, cross(u, planar_hitpt_vector));
+
+        return alpha >= 0 && alpha <= 1 && beta >= 0 && beta <= 1;
+    }
+};
+
+bool quad::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    double t, alpha, beta;
+    if (!intersect(r, t_min, t_max, t, alpha, beta))
+        return false;
+
+    rec.set_deferred(this, t);
+    return true;
+}
+
+void quad::compute_surface_interaction(const ray& r, hit_record& rec) const {
+    rec.p = r.at(rec.t);
+    auto planar_hitpt_vector = rec.p - Q;
+    rec.u = dot(w, cross(planar_hitpt_vector, v));
+    rec.v = dot(w, cross(u, planar_hitpt_vector));
+    rec.set_face_normal(r, normal);
+    rec.mat_ptr = mp.get();
+}
+
+bool quad::bounding_box(double time0, double time1, aabb& output_box) const {
+    point3 small(infinity, infinity, infinity);
+    point3 big(-infinity, -infinity, -infinity);
+
+    point3 corners[4] = { Q, Q + u, Q + v, Q + u + v };
+    for (const auto& c : corners) {
+        for (int a = 0; a < 3; a++) {
+            small[a] = fmin(small[a], c[a]);
+            big[a] = fmax(big[a], c[a]);
+        }
+    }
+
+    // The bounding box must have non-zero width in each dimension, so pad any
+    // dimension the quad is flat in.
+    for (int a = 0; a < 3; a++) {
+        if (big[a] - small[a] < 0.0002) {
+            small[a] -= 0.0001;
+            big[a] += 0.0001;
+        }
+    }
+
+    output_box = aabb(small, big);
+    return true;
+}
+
+double quad::pdf_value(const point3& origin, const vec3& direction) const {
+    // Solid-angle pdf of uniform area sampling: only the plane test is needed to know
+    // whether the direction reaches the quad and how far away it is.
+    double t, alpha, beta;
+    if (!intersect(ray(origin, direction), 0.001, infinity, t, alpha, beta))
+        return 0;
+
+    auto distance_squared = t * t * direction.length_squared();
+    auto cosine = fabs(dot(direction, normal) / direction.length());
+
+    return distance_squared / (cosine * area);
+}
+
+vec3 quad::random(const point3& origin) const {
+    double u1, u2;
+    random_double2(u1, u2);
+    auto p = Q + (u1 * u) + (u2 * v);
+    return p - origin;
+}
+
+#endif
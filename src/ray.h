@@ -3,6 +3,8 @@
 
 #include "vec3.h"
 
+class hittable;
+
 class ray {
 public:
     ray() {}
@@ -18,10 +20,29 @@ public:
         return orig + t * dir;
     }
 
+    // Width of the ray cone at a given distance from the origin.
+    double footprint(double distance) const {
+        return cone_width + cone_spread * distance;
+    }
+
+    // Starts this ray's cone where the parent ray hit object at parameter t. The cone
+    // never narrows along a path; rough bounces pass a wider min_spread.
+    void continue_cone(const ray& parent, double t, const hittable* object, double min_spread = 0) {
+        cone_width = parent.footprint(t * parent.dir.length());
+        cone_spread = parent.cone_spread > min_spread ? parent.cone_spread : min_spread;
+        origin_object = object;
+    }
+
 public:
     point3 orig;
     vec3 dir;
     double tm;
+
+    // Ray cone used for level-of-detail selection: width at the origin and spread angle.
+    double cone_width = 0;
+    double cone_spread = 0;
+    // The primitive the ray starts on, if any.
+    const hittable* origin_object = nullptr;
 };
 
 #endif
\ No newline at end of file
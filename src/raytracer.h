@@ -4,50 +4,143 @@
 
 #include "hittable_list.h"
 #include "sphere.h"
+#include "sphere_set.h"
 #include "camera.h"
 #include "material.h"
 #include "moving_sphere.h"
 #include "aarect.h"
+#include "quad.h"
 #include "box.h"
-//#include "constant_medium.h"
+#include "triangle_mesh.h"
+#include "lod_mesh.h"
+#include "subdivision_surface.h"
+#include "paged_scene.h"
+#include "sdf.h"
+#include "curves.h"
+#include "constant_medium.h"
+#include "heterogeneous_medium.h"
+#include "sparse_grid.h"
 #include "bvh.h"
 #include "pdf.h"
+#include "light_sampler.h"
+#include "light_bvh.h"
+#include "sampler.h"
 
 #include "ThreadPool.h"
 
+#include <atomic>
+
+// Spread given to ray cones after a non-specular bounce, for level-of-detail selection.
+const double diffuse_cone_spread = 0.1;
+
+// Bounces after which paths are subject to Russian roulette.
+const int russian_roulette_depth = 3;
+
+// Paths are traced with next-event estimation: at every non-specular vertex one light
+// sample is taken with a shadow ray, and emission found by the scattered ray is still
+// counted. The two are weighted with the power heuristic, so each light path is
+// counted once by whichever strategy sampled it better.
 color ray_color(
-	const ray& r, const color& background, const hittable& world,
-	shared_ptr<hittable> lights, int depth
+	const ray& r_in, const color& background, const hittable& world,
+	const light_sampler& lights, int max_depth
 ) {
-	hit_record rec;
+	color radiance(0, 0, 0);
+	color throughput(1, 1, 1);
+	ray r = r_in;
+
+	// How the current ray was sampled, for weighting the emission it finds.
+	bool sampled_specular = true;
+	double sampled_pdf = 0;
+	point3 sampled_from;
+
+	// Past max_depth bounces no more light is gathered.
+	for (int depth = 0; depth < max_depth; depth++) {
+		hit_record rec;
+
+		// If the ray hits nothing, add the background color.
+		if (!world.hit(r, 0.001, infinity, rec)) {
+			radiance += throughput * background;
+			break;
+		}
+		rec.compute_surface_interaction(r);
+
+		color emitted = rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p);
+		if (emitted.length_squared() > 0) {
+			// Emitters that aren't among the lights can only be found this way.
+			auto weight = 1.0;
+			int light = lights.light_index(rec.obj);
+			if (!sampled_specular && light >= 0)
+				weight = power_heuristic(sampled_pdf, lights.pdf_value(sampled_from, r.direction(), light));
+			radiance += weight * throughput * emitted;
+		}
 
-	// If we've exceeded the ray bounce limit, no more light is gathered.
-	if (depth <= 0)
-		return color(0, 0, 0);
+		scatter_record srec;
+		if (!rec.mat_ptr->scatter(r, rec, srec))
+			break;
 
-	// If the ray hits nothing, return the background color.
-	if (!world.hit(r, 0.001, infinity, rec))
-		return background;
+		if (srec.is_specular) {
+			srec.specular_ray.continue_cone(r, rec.t, rec.obj);
+			throughput = throughput * srec.attenuation;
+			r = srec.specular_ray;
+			sampled_specular = true;
+		}
+		else {
+			// Light sample. It counts only if the shadow ray's first surface hit is the
+			// light that was sampled, matching the pdf used when the material sample finds
+			// it. Media on the way attenuate it rather than block it.
+			double pmf;
+			int light = lights.sample(rec.p, random_double(), pmf);
+			ray to_light(rec.p, light >= 0 ? lights.light(light).random(rec.p) : vec3(1, 0, 0), r.time());
+			auto light_pdf = light >= 0 ? pmf * lights.light(light).pdf_value(rec.p, to_light.direction()) : 0;
+			// Same cone as the scattered ray, so an LOD mesh keeps the level the path is on.
+			to_light.continue_cone(r, rec.t, rec.obj, diffuse_cone_spread);
+			hit_record lrec;
+			bool unblocked = false;
+			if (light_pdf > 0) {
+				auto t_min = 0.001;
+				while ((unblocked = world.hit(to_light, t_min, infinity, lrec)) && lrec.obj->has_media())
+					t_min = lrec.t + 0.001;
+			}
+			if (unblocked && lights.light_index(lrec.obj) == light) {
+				lrec.compute_surface_interaction(to_light);
+				color light_emitted = lrec.mat_ptr->emitted(to_light, lrec, lrec.u, lrec.v, lrec.p);
+				auto tr = world.has_media() ? world.transmittance(to_light, 0.001, lrec.t) : 1.0;
+				if (light_emitted.length_squared() > 0 && tr > 0) {
+					auto f = srec.attenuation * rec.mat_ptr->scattering_pdf(r, rec, to_light);
+					auto weight = power_heuristic(light_pdf, srec.sampling_pdf.value(to_light.direction()));
+					radiance += throughput * f * tr * light_emitted * (weight / light_pdf);
+				}
+			}
 
-	scatter_record srec;
-	color emitted = rec.mat_ptr->emitted(r, rec, rec.u, rec.v, rec.p);
-	if (!rec.mat_ptr->scatter(r, rec, srec))
-		return emitted;
+			// Material sample, which continues the path.
+			ray scattered = ray(rec.p, srec.sampling_pdf.generate(), r.time());
+			scattered.continue_cone(r, rec.t, rec.obj, diffuse_cone_spread);
+			auto pdf_val = srec.sampling_pdf.value(scattered.direction());
+			if (pdf_val <= 0)
+				break;
+
+			throughput = throughput * srec.attenuation
+				* rec.mat_ptr->scattering_pdf(r, rec, scattered) / pdf_val;
+			r = scattered;
+			sampled_specular = false;
+			sampled_pdf = pdf_val;
+			sampled_from = rec.p;
+		}
 
-	if (srec.is_specular) {
-		return srec.attenuation
-			* ray_color(srec.specular_ray, background, world, lights, depth - 1);
+		// Russian roulette: end dim paths early and weight the survivors up to keep
+		// the estimate unbiased. It waits russian_roulette_depth bounces because the
+		// first few carry most of the light, and killing them would add the most
+		// noise; by then the throughput also says how much the rest of the path can
+		// still bring back.
+		if (depth >= russian_roulette_depth) {
+			auto survival = fmin(0.95, fmax(throughput.x(), fmax(throughput.y(), throughput.z())));
+			if (random_double() >= survival)
+				break;
+			throughput = throughput / survival;
+		}
 	}
 
-	auto light_ptr = make_shared<hittable_pdf>(lights, rec.p);
-	mixture_pdf p(light_ptr, srec.pdf_ptr);
-
-	ray scattered = ray(rec.p, p.generate(), r.time());
-	auto pdf_val = p.value(scattered.direction());
-
-	return emitted
-		+ srec.attenuation * rec.mat_ptr->scattering_pdf(r, rec, scattered)
-		* ray_color(scattered, background, world, lights, depth - 1) / pdf_val;
+	return radiance;
 }
 
 // screen
@@ -56,6 +149,30 @@ int image_height = 600;
 int samples_per_pixel = 100;
 const int max_depth = 50;
 
+// adaptive sampling: the image has a budget of samples_per_pixel samples per pixel on
+// average. A pixel takes at least adaptive_min_samples, then stops once the 95%
+// confidence interval of its displayed brightness is narrower than the tolerance, and
+// the samples it didn't take go to the pixels still sampling, in later passes. No
+// pixel takes more than adaptive_max_factor * samples_per_pixel, so a few noisy
+// pixels can't use up the whole budget.
+bool adaptive_sampling = true;
+float adaptive_tolerance = 0.02f;
+int adaptive_min_samples = 16;
+int adaptive_max_factor = 4;
+// Testing after every sample would stop too many pixels on a lucky streak.
+const int adaptive_check_interval = 8;
+
+// progressive rendering: the image is rendered in passes of samples_per_pass samples
+// per pixel, accumulated in the film, and the displayed pixels are refreshed after
+// every pass. Passes go on until every pixel has converged or reached its maximum,
+// the sample budget is spent, or stop() is called.
+int samples_per_pass = 1;
+
+// Where the random numbers of each pixel sample come from. The sampler is active
+// while the sample is traced, so the camera, materials and lights all draw from it.
+enum class sampler_type { independent, halton, sobol };
+sampler_type pixel_sampler = sampler_type::sobol;
+
 // camera
 point3 lookfrom(278, 278, -800);
 point3 lookat(278, 278, 0);
@@ -66,21 +183,41 @@ float aperture = 0.0f;
 color background(0, 0, 0);
 
 // multi-threading
-ThreadPool pool(std::thread::hardware_concurrency() - 1);
+// At least one worker, even where the hardware concurrency is unknown or a single core.
+ThreadPool pool(std::max(2u, std::thread::hardware_concurrency()) - 1);
 std::mutex tile_mutex;
 int finishedTileCount = 0;
 int totalTileCount = 0;
 double startTime = 0;
 int tileSize = 16;
+std::atomic<long long> sampleCount(0);
+long long sampleBudget = 0;
+int passSamples = 0;	// samples each active pixel takes in the current pass
+std::atomic<int> activePixelCount(0);
+std::atomic<bool> stopRequested(false);
+int passCount = 0;
+bool renderRunning = false;
+std::condition_variable render_finished;
 
 class raytracer {
 	hittable_list world;
-	shared_ptr<hittable_list> lights = make_shared<hittable_list>();
+	shared_ptr<light_sampler> lights;
 	camera cam;
 	uint8_t* pixels = nullptr;
 
+	// Running state of a pixel over the passes. mean and m2 track the luminance of its
+	// samples with Welford's algorithm, for adaptive sampling.
+	struct film_pixel {
+		color sum;
+		int samples = 0;
+		double mean = 0;
+		double m2 = 0;
+		bool done = false;
+	};
+	std::vector<film_pixel> film;
+
 public:
-	void write_color(color pixel_color, int i, int j)
+	void write_color(color pixel_color, int samples, int i, int j)
 	{
 		auto r = pixel_color.x();
 		auto g = pixel_color.y();
@@ -92,7 +229,7 @@ public:
 		if (b != b) b = 0.0;
 
 		// Divide the color by the number of samples and gamma-correct for gamma=2.0.
-		auto scale = 1.0 / samples_per_pixel;
+		auto scale = 1.0 / samples;
 		r = sqrt(scale * r);
 		g = sqrt(scale * g);
 		b = sqrt(scale * b);
@@ -105,11 +242,74 @@ public:
 		pixels[index * 4 + 3] = 255;
 	}
 
-	void init_cornell_box()
+	// Adds a pass worth of samples to pixel (i, j) and refreshes it on screen; returns
+	// whether it needs more. A pixel is done at its maximum sample count, or once the
+	// 95% confidence interval of its brightness is narrower than the tolerance, tested
+	// every adaptive_check_interval samples. The brightness is displayed gamma-corrected,
+	// so the interval is measured after the square root.
+	bool sample_pixel(int i, int j)
+	{
+		film_pixel& px = film[i + j * image_width];
+		if (px.done)
+			return false;
+
+		int min_samples = adaptive_sampling ? std::min(adaptive_min_samples, samples_per_pixel) : samples_per_pixel;
+		int max_samples = adaptive_sampling ? samples_per_pixel * adaptive_max_factor : samples_per_pixel;
+
+		independent_sampler independent;
+		sobol_sampler sobol;
+		halton_sampler halton;
+		sampler* smp = pixel_sampler == sampler_type::sobol ? static_cast<sampler*>(&sobol)
+			: pixel_sampler == sampler_type::halton ? static_cast<sampler*>(&halton) : &independent;
+		sampler_scope scope(smp);
+
+		int taken = 0;
+		for (; taken < passSamples && px.samples < max_samples; taken++) {
+			smp->start_pixel_sample(i, j, px.samples);
+			double du, dv;
+			random_double2(du, dv);
+			auto u = (i + du) / (image_width - 1);
+			auto v = (j + dv) / (image_height - 1);
+			ray r = cam.get_ray(u, v);
+			color c = ray_color(r, background, world, *lights, max_depth);
+			px.sum += c;
+
+			auto y = luminance(c);
+			if (y != y)
+				y = 0;
+			px.samples++;
+			auto delta = y - px.mean;
+			px.mean += delta / px.samples;
+			px.m2 += delta * (y - px.mean);
+		}
+		sampleCount += taken;
+		write_color(px.sum, px.samples, i, j);
+
+		if (px.samples >= max_samples)
+			px.done = true;
+		else if (adaptive_sampling && px.samples >= std::max(min_samples, 2) && px.samples % adaptive_check_interval == 0) {
+			auto half_width = 1.96 * sqrt(px.m2 / (px.samples - 1) / px.samples);
+			px.done = px.mean - half_width >= 1
+				|| sqrt(px.mean + half_width) - sqrt(fmax(px.mean - half_width, 0.0)) < 2 * adaptive_tolerance;
+		}
+		return !px.done;
+	}
+
+	// Ends a progressive render early. The pass in flight skips its remaining tiles.
+	void stop()
 	{
-		lights->add(make_shared<xz_rect>(213, 343, 227, 332, 554, shared_ptr<material>()));
-		lights->add(make_shared<sphere>(point3(190, 90, 190), 90, shared_ptr<material>()));
+		stopRequested = true;
+	}
 
+	// Blocks until an async render has finished, so its buffers can be released.
+	void wait()
+	{
+		std::unique_lock<std::mutex> lock(tile_mutex);
+		render_finished.wait(lock, [] { return !renderRunning; });
+	}
+
+	void init_cornell_box()
+	{
 		auto red = make_shared<lambertian>(color(.65, .05, .05));
 		auto white = make_shared<lambertian>(color(.73, .73, .73));
 		auto green = make_shared<lambertian>(color(.12, .45, .15));
@@ -138,89 +338,142 @@ public:
 	}
 
 	void render(uint8_t* _pixels)
+	{
+		begin(_pixels);
+
+		std::lock_guard<std::mutex> lock(tile_mutex);
+		renderRunning = true;
+		if (!start_pass())
+			finish_async();
+	}
+
+	void render_sync(uint8_t* _pixels)
+	{
+		begin(_pixels);
+
+		int active = image_width * image_height;
+		while (plan_pass(active) && !stopRequested) {
+			active = 0;
+			for (int j = 0; j < image_height; j++)
+			{
+				for (int i = 0; i < image_width; i++) // go horizontal line first
+				{
+					if (sample_pixel(i, j))
+						active++;
+				}
+			}
+			passCount++;
+		}
+
+		std::cout << "render sync finished, spent " << glfwGetTime() - startTime << "s, " << passCount << " passes, "
+			<< sampleCount / double(image_width * image_height) << " samples per pixel." << std::endl;
+	}
+
+private:
+	void begin(uint8_t* _pixels)
 	{
 		pixels = _pixels;
 		startTime = glfwGetTime();
-
-		// world
+		sampleCount = 0;
+		sampleBudget = static_cast<long long>(samples_per_pixel) * image_width * image_height;
+		passCount = 0;
+		activePixelCount = image_width * image_height;
+		stopRequested = false;
+
+		// world, and the lights found in it
+		world.clear();
 		init_cornell_box();
+		lights = build_light_bvh(world);
 
 		// Camera
-		cam.init(lookfrom, lookat, vup, vfov, image_width / (float)image_height, aperture, dist_to_focus, 0.0, 1.0);
+		cam.init(lookfrom, lookat, vup, vfov, image_width / (float)image_height, aperture, dist_to_focus, 0.0, 1.0, image_height);
+
+		film.assign(image_width * image_height, film_pixel());
+	}
+
+	// Sets how many samples each of the active pixels left by the last pass takes in
+	// the next one: samples_per_pass, or an even share of what is left of the budget
+	// once that is less. Returns false when no pixel is active or the budget is spent.
+	bool plan_pass(int active)
+	{
+		if (active <= 0)
+			return false;
+		auto remaining = sampleBudget - sampleCount;
+		passSamples = static_cast<int>(std::min<long long>(samples_per_pass, remaining / active));
+		return passSamples > 0;
+	}
+
+	// Queues one pass over the image, a task per tile. The tile that finishes the pass
+	// queues the next. Called with tile_mutex held. Returns false when nothing was
+	// queued, because the render is over, a stop was requested or the pool is shutting
+	// down; if the pool stops partway, the tiles already queued finish the render.
+	bool start_pass()
+	{
+		if (stopRequested || !plan_pass(activePixelCount))
+			return false;
 
 		int xTiles = (image_width + tileSize - 1) / tileSize;
 		int yTiles = (image_height + tileSize - 1) / tileSize;
 
 		totalTileCount = xTiles * yTiles;
 		finishedTileCount = 0;
+		activePixelCount = 0;
 
-		auto renderTile = [&](int xTile, int yTile) {
-			int xStart = xTile * tileSize;
-			int yStart = yTile * tileSize;
-			for (int j = yStart; j < yStart + tileSize; j++)
-			{
-				for (int i = xStart; i < xStart + tileSize; i++)
-				{
-					// bounds check
-					if (i >= image_width || j >= image_height)
-						continue;
-
-					color pixel_color(0, 0, 0);
-					for (int s = 0; s < samples_per_pixel; s++) {
-						auto u = (i + random_double()) / (image_width - 1);
-						auto v = (j + random_double()) / (image_height - 1);
-						ray r = cam.get_ray(u, v);
-						pixel_color += ray_color(r, background, world, lights, max_depth);
-					}
-
-					write_color(pixel_color, i, j);
-				}
-			}
+		int queued = 0;
+		try
+		{
+			for (int i = 0; i < xTiles; i++)
 			{
-				std::lock_guard<std::mutex> lock(tile_mutex);
-				finishedTileCount++;
-				if (finishedTileCount == totalTileCount)
+				for (int j = 0; j < yTiles; j++)
 				{
-					std::cout << "render async finished, spent " << glfwGetTime() - startTime << "s." << std::endl;
+					pool.enqueue([this](int xTile, int yTile) { render_tile(xTile, yTile); }, i, j);
+					queued++;
 				}
 			}
-		};
-
-		for (int i = 0; i < xTiles; i++)
+		}
+		catch (const std::runtime_error&)
 		{
-			for (int j = 0; j < yTiles; j++)
-			{
-				pool.enqueue(renderTile, i, j);
-			}
+			stopRequested = true;
+			totalTileCount = queued;
 		}
+		return queued > 0;
 	}
 
-	void render_sync(uint8_t* _pixels)
+	// Called with tile_mutex held.
+	void finish_async()
 	{
-		pixels = _pixels;
-		startTime = glfwGetTime();
-
-		// world
-		init_cornell_box();
-
-		// Camera
-		cam.init(lookfrom, lookat, vup, vfov, image_width / (float)image_height, aperture, dist_to_focus, 0.0, 1.0);
+		std::cout << "render async finished, spent " << glfwGetTime() - startTime << "s, " << passCount << " passes, "
+			<< sampleCount / double(image_width * image_height) << " samples per pixel." << std::endl;
+		renderRunning = false;
+		render_finished.notify_all();
+	}
 
-		for (int j = 0; j < image_height; j++)
+	void render_tile(int xTile, int yTile)
+	{
+		int xStart = xTile * tileSize;
+		int yStart = yTile * tileSize;
+		int active = 0;
+		for (int j = yStart; j < yStart + tileSize && !stopRequested; j++)
 		{
-			for (int i = 0; i < image_width; i++) // go horizontal line first
+			for (int i = xStart; i < xStart + tileSize; i++)
 			{
-				color pixel_color(0, 0, 0);
-				for (int s = 0; s < samples_per_pixel; ++s) {
-					auto u = (i + random_double()) / (image_width - 1);
-					auto v = (j + random_double()) / (image_height - 1);
-					ray r = cam.get_ray(u, v);
-					pixel_color += ray_color(r, background, world, lights, max_depth);
-				}
+				// bounds check
+				if (i >= image_width || j >= image_height)
+					continue;
 
-				write_color(pixel_color, i, j);
+				if (sample_pixel(i, j))
+					active++;
 			}
 		}
-		std::cout << "render sync finished, spent " << glfwGetTime() - startTime << "s." << std::endl;
+		activePixelCount += active;
+
+		std::lock_guard<std::mutex> lock(tile_mutex);
+		finishedTileCount++;
+		if (finishedTileCount == totalTileCount)
+		{
+			passCount++;
+			if (!start_pass())
+				finish_async();
+		}
 	}
 };
\ No newline at end of file
@@ -0,0 +1,61 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <cstdint>
+
+// PCG32 (O'Neill): a 64-bit LCG whose output is permuted down to 32 bits. The state
+// is 16 bytes and a number costs a multiply-add, so every thread can own one. Each
+// sequence index selects an independent stream, and advance() jumps ahead in
+// O(log n), which makes the generator counter-based in practice: the numbers for
+// (stream, position) are found without drawing the ones before them.
+class pcg32 {
+public:
+    pcg32() { set_sequence(default_stream); }
+    pcg32(uint64_t sequence_index, uint64_t seed = default_seed) { set_sequence(sequence_index, seed); }
+
+    void set_sequence(uint64_t sequence_index, uint64_t seed = default_seed) {
+        state = 0;
+        inc = (sequence_index << 1) | 1;
+        next_uint();
+        state += seed;
+        next_uint();
+    }
+
+    uint32_t next_uint() {
+        auto old = state;
+        state = old * multiplier + inc;
+        auto xorshifted = static_cast<uint32_t>(((old >> 18) ^ old) >> 27);
+        auto rot = static_cast<uint32_t>(old >> 59);
+        return (xorshifted >> rot) | (xorshifted << ((~rot + 1) & 31));
+    }
+
+    // [0, 1), with all 32 bits.
+    double next_double() {
+        return next_uint() * (1.0 / 4294967296.0);
+    }
+
+    // Skips delta numbers (Brown, "Random Number Generation with Arbitrary Strides").
+    void advance(uint64_t delta) {
+        uint64_t cur_mult = multiplier, cur_plus = inc, acc_mult = 1, acc_plus = 0;
+        while (delta > 0) {
+            if (delta & 1) {
+                acc_mult *= cur_mult;
+                acc_plus = acc_plus * cur_mult + cur_plus;
+            }
+            cur_plus = (cur_mult + 1) * cur_plus;
+            cur_mult *= cur_mult;
+            delta >>= 1;
+        }
+        state = acc_mult * state + acc_plus;
+    }
+
+private:
+    static const uint64_t multiplier = 0x5851f42d4c957f2dull;
+    static const uint64_t default_stream = 0xda3e39cb94b95bdbull;
+    static const uint64_t default_seed = 0x853c49e6748fea9bull;
+
+    uint64_t state;
+    uint64_t inc;
+};
+
+#endif
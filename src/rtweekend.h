@@ -4,7 +4,9 @@
 #include <cmath>
 #include <limits>
 #include <memory>
-#include <random>
+#include <atomic>
+
+#include "sampler.h"
 
 // Usings
 
@@ -23,10 +25,33 @@ inline double degrees_to_radians(double degrees) {
     return degrees * pi / 180.0;
 }
 
+// The generator for random numbers drawn outside a pixel sample. Each thread gets its
+// own stream, so drawing takes no lock and shares no cache line with other threads.
+inline pcg32& thread_rng() {
+    static std::atomic<uint64_t> next_stream(0);
+    thread_local pcg32 rng(next_stream++);
+    return rng;
+}
+
+// Returns a random real in [0,1): the next dimension of the thread's active sampler,
+// or a number from the thread's own generator when there is none.
 inline double random_double() {
-    static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    static std::mt19937 generator;
-    return distribution(generator);
+    if (sampler* s = sampler::active())
+        return s->get_1d();
+
+    return thread_rng().next_double();
+}
+
+// Two random reals in [0,1) meant to be used together, such as the coordinates of a
+// point on a surface, so a sampler can stratify them as a pair.
+inline void random_double2(double& u1, double& u2) {
+    if (sampler* s = sampler::active()) {
+        s->get_2d(u1, u2);
+        return;
+    }
+
+    u1 = random_double();
+    u2 = random_double();
 }
 
 inline double random_double(double min, double max) {
@@ -0,0 +1,219 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <cmath>
+#include <cstdint>
+
+#include "rng.h"
+
+// Supplies the random numbers of a path as dimensions of a sample: sample index of
+// pixel (x, y), dimension d. Samplers that see the whole set of samples of a pixel can
+// spread them far more evenly than independent numbers would.
+//
+// A sampler is made active on a thread with sampler_scope; random_double() and
+// random_double2() then draw its next dimensions, so the camera, materials and lights
+// use it without being handed it.
+class sampler {
+public:
+    virtual ~sampler() {}
+
+    // Starts sample index of pixel (x, y), from dimension zero.
+    virtual void start_pixel_sample(int x, int y, int index) = 0;
+
+    virtual double get_1d() = 0;
+
+    // The next two dimensions, distributed well as a pair.
+    virtual void get_2d(double& u1, double& u2) = 0;
+
+    static sampler*& active() {
+        thread_local sampler* current = nullptr;
+        return current;
+    }
+};
+
+// Makes a sampler active on this thread for its lifetime. A null sampler means
+// independent random numbers.
+class sampler_scope {
+public:
+    sampler_scope(sampler* s) : previous(sampler::active()) { sampler::active() = s; }
+    ~sampler_scope() { sampler::active() = previous; }
+
+    sampler_scope(const sampler_scope&) = delete;
+    sampler_scope& operator=(const sampler_scope&) = delete;
+
+private:
+    sampler* previous;
+};
+
+inline uint64_t mix_bits(uint64_t v) {
+    v ^= v >> 31;
+    v *= 0x7fb5d329728ea185ull;
+    v ^= v >> 27;
+    v *= 0x81dadef4bc2dd44dull;
+    v ^= v >> 33;
+    return v;
+}
+
+inline uint64_t hash_combine(uint64_t seed, uint64_t v) {
+    return mix_bits(seed ^ (v + 0x9e3779b97f4a7c15ull + (seed << 6) + (seed >> 2)));
+}
+
+// [0, 1) from all 32 bits.
+inline double bits_to_unit(uint32_t x) {
+    return x * (1.0 / 4294967296.0);
+}
+
+// Independent uniform numbers that are still reproducible: sample index of pixel
+// (x, y) starts at its own position of a PCG32 stream picked by the pixel, and its
+// dimensions follow in order, so a render doesn't depend on which thread traced what.
+class independent_sampler : public sampler {
+public:
+    independent_sampler(uint32_t seed = 0) : seed(seed) {}
+
+    virtual void start_pixel_sample(int x, int y, int index) override {
+        rng.set_sequence(hash_combine(mix_bits((uint64_t(uint32_t(x)) << 32) | uint32_t(y)), seed));
+        rng.advance(uint64_t(uint32_t(index)) * 65536);
+    }
+
+    virtual double get_1d() override {
+        return rng.next_double();
+    }
+
+    virtual void get_2d(double& u1, double& u2) override {
+        u1 = rng.next_double();
+        u2 = rng.next_double();
+    }
+
+private:
+    uint32_t seed;
+    pcg32 rng;
+};
+
+// Sobol points with Owen scrambling, from hashing (Burley, "Practical Hash-based Owen
+// Scrambling"). Only the first two Sobol dimensions are used: every 1D or 2D request
+// takes them at a sample index shuffled by its own seed, which pads them into as many
+// dimensions as a path needs without the sets being correlated. Pixels get their own
+// seeds too.
+class sobol_sampler : public sampler {
+public:
+    sobol_sampler(uint32_t seed = 0) : seed(seed) {}
+
+    virtual void start_pixel_sample(int x, int y, int index) override {
+        pixel_seed = hash_combine(mix_bits((uint64_t(uint32_t(x)) << 32) | uint32_t(y)), seed);
+        sample_index = uint32_t(index);
+        dimension = 0;
+    }
+
+    virtual double get_1d() override {
+        auto s = static_cast<uint32_t>(hash_combine(pixel_seed, dimension++));
+        auto i = nested_uniform_scramble(sample_index, s);
+        return bits_to_unit(nested_uniform_scramble(reverse_bits(i), static_cast<uint32_t>(hash_combine(s, 0))));
+    }
+
+    virtual void get_2d(double& u1, double& u2) override {
+        auto s = static_cast<uint32_t>(hash_combine(pixel_seed, dimension++));
+        auto i = nested_uniform_scramble(sample_index, s);
+        u1 = bits_to_unit(nested_uniform_scramble(reverse_bits(i), static_cast<uint32_t>(hash_combine(s, 0))));
+        u2 = bits_to_unit(nested_uniform_scramble(sobol_second(i), static_cast<uint32_t>(hash_combine(s, 1))));
+    }
+
+    static uint32_t reverse_bits(uint32_t x) {
+        x = (x << 16) | (x >> 16);
+        x = ((x & 0x00ff00ff) << 8) | ((x & 0xff00ff00) >> 8);
+        x = ((x & 0x0f0f0f0f) << 4) | ((x & 0xf0f0f0f0) >> 4);
+        x = ((x & 0x33333333) << 2) | ((x & 0xcccccccc) >> 2);
+        x = ((x & 0x55555555) << 1) | ((x & 0xaaaaaaaa) >> 1);
+        return x;
+    }
+
+    // Owen scrambling of the bits from most to least significant, by a hash that only
+    // lets each bit depend on the bits below it (Laine and Karras), applied reversed.
+    static uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+        x = reverse_bits(x);
+        x += seed;
+        x ^= x * 0x6c50b47cu;
+        x ^= x * 0xb82f1e52u;
+        x ^= x * 0xc7afe638u;
+        x ^= x * 0x8d22f6e6u;
+        return reverse_bits(x);
+    }
+
+    // Second Sobol dimension, from the primitive polynomial x + 1. The first is the
+    // bit reversal of the index.
+    static uint32_t sobol_second(uint32_t index) {
+        uint32_t result = 0;
+        uint32_t v = 1u << 31;
+        for (; index; index >>= 1, v ^= v >> 1)
+            if (index & 1)
+                result ^= v;
+        return result;
+    }
+
+private:
+    uint32_t seed;
+    uint64_t pixel_seed = 0;
+    uint32_t sample_index = 0;
+    uint32_t dimension = 0;
+};
+
+// The Halton sequence: dimension d is the radical inverse of the sample index in the
+// d-th prime base. Each pixel shifts every dimension by its own random offset modulo
+// one (Cranley-Patterson rotation), so neighbouring pixels don't share their error.
+// Dimensions past the table of bases are independent hashed numbers.
+class halton_sampler : public sampler {
+public:
+    halton_sampler(uint32_t seed = 0) : seed(seed) {}
+
+    virtual void start_pixel_sample(int x, int y, int index) override {
+        pixel_seed = hash_combine(mix_bits((uint64_t(uint32_t(x)) << 32) | uint32_t(y)), seed);
+        sample_index = uint64_t(index);
+        dimension = 0;
+    }
+
+    virtual double get_1d() override {
+        auto d = dimension++;
+        auto dimension_seed = hash_combine(pixel_seed, d);
+        if (d >= prime_count)
+            return bits_to_unit(static_cast<uint32_t>(hash_combine(dimension_seed, sample_index)));
+
+        auto shift = bits_to_unit(static_cast<uint32_t>(dimension_seed));
+        auto x = radical_inverse(primes()[d], sample_index) + shift;
+        return x >= 1 ? x - 1 : x;
+    }
+
+    virtual void get_2d(double& u1, double& u2) override {
+        u1 = get_1d();
+        u2 = get_1d();
+    }
+
+    static double radical_inverse(uint32_t base, uint64_t index) {
+        auto inv_base = 1.0 / base;
+        auto inv_base_n = 1.0;
+        uint64_t reversed = 0;
+        while (index) {
+            auto next = index / base;
+            reversed = reversed * base + (index - next * base);
+            inv_base_n *= inv_base;
+            index = next;
+        }
+        return fmin(reversed * inv_base_n, 0.99999999999999989);
+    }
+
+    static const uint32_t prime_count = 32;
+
+    static const uint32_t* primes() {
+        static const uint32_t table[prime_count] = {
+            2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+            59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131
+        };
+        return table;
+    }
+
+private:
+    uint32_t seed;
+    uint64_t pixel_seed = 0;
+    uint64_t sample_index = 0;
+    uint32_t dimension = 0;
+};
+
+#endif
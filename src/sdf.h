@@ -0,0 +1,407 @@
+#ifndef SDF_H
+#define SDF_H
+
+#include "rtweekend.h"
+
+#include "aabb.h"
+#include "hittable.h"
+
+#include <algorithm>
+#include <vector>
+
+// A node of a signed distance function: negative inside, positive outside. Nodes that
+// are only distance bounds (smooth blends, fractal estimators) must still never
+// overestimate, so sphere tracing stays safe.
+class sdf_node {
+public:
+    virtual ~sdf_node() {}
+
+    virtual double distance(const point3& p) const = 0;
+
+    // The gradient at p, for nodes that know it in closed form.
+    virtual bool gradient(const point3& p, vec3& g) const {
+        return false;
+    }
+};
+
+// Gradient from four evaluations at the corners of a tetrahedron around p (Quilez).
+inline vec3 sdf_tetrahedral_gradient(const sdf_node& f, const point3& p, double h) {
+    const vec3 k0(1, -1, -1), k1(-1, -1, 1), k2(-1, 1, -1), k3(1, 1, 1);
+    return k0 * f.distance(p + h * k0) + k1 * f.distance(p + h * k1)
+        + k2 * f.distance(p + h * k2) + k3 * f.distance(p + h * k3);
+}
+
+class sdf_sphere : public sdf_node {
+public:
+    sdf_sphere(point3 c, double r) : center(c), radius(r) {}
+
+    virtual double distance(const point3& p) const override {
+        return (p - center).length() - radius;
+    }
+
+    virtual bool gradient(const point3& p, vec3& g) const override {
+        g = p - center;
+        return g.length_squared() > 0;
+    }
+
+public:
+    point3 center;
+    double radius;
+};
+
+class sdf_box : public sdf_node {
+public:
+    sdf_box(point3 c, vec3 half) : center(c), half_size(half) {}
+
+    virtual double distance(const point3& p) const override {
+        auto q = p - center;
+        vec3 d(fabs(q.x()) - half_size.x(), fabs(q.y()) - half_size.y(), fabs(q.z()) - half_size.z());
+        vec3 outside(fmax(d.x(), 0.0), fmax(d.y(), 0.0), fmax(d.z(), 0.0));
+        return outside.length() + fmin(fmax(d.x(), fmax(d.y(), d.z())), 0.0);
+    }
+
+public:
+    point3 center;
+    vec3 half_size;
+};
+
+// A torus around the y axis.
+class sdf_torus : public sdf_node {
+public:
+    sdf_torus(point3 c, double major, double minor) : center(c), major_radius(major), minor_radius(minor) {}
+
+    virtual double distance(const point3& p) const override {
+        auto q = p - center;
+        auto ring = sqrt(q.x() * q.x() + q.z() * q.z()) - major_radius;
+        return sqrt(ring * ring + q.y() * q.y()) - minor_radius;
+    }
+
+public:
+    point3 center;
+    double major_radius;
+    double minor_radius;
+};
+
+class sdf_union : public sdf_node {
+public:
+    sdf_union(shared_ptr<sdf_node> a, shared_ptr<sdf_node> b) : left(a), right(b) {}
+
+    virtual double distance(const point3& p) const override {
+        return fmin(left->distance(p), right->distance(p));
+    }
+
+    virtual bool gradient(const point3& p, vec3& g) const override {
+        return left->distance(p) < right->distance(p) ? left->gradient(p, g) : right->gradient(p, g);
+    }
+
+public:
+    shared_ptr<sdf_node> left;
+    shared_ptr<sdf_node> right;
+};
+
+class sdf_intersection : public sdf_node {
+public:
+    sdf_intersection(shared_ptr<sdf_node> a, shared_ptr<sdf_node> b) : left(a), right(b) {}
+
+    virtual double distance(const point3& p) const override {
+        return fmax(left->distance(p), right->distance(p));
+    }
+
+    virtual bool gradient(const point3& p, vec3& g) const override {
+        return left->distance(p) > right->distance(p) ? left->gradient(p, g) : right->gradient(p, g);
+    }
+
+public:
+    shared_ptr<sdf_node> left;
+    shared_ptr<sdf_node> right;
+};
+
+// left with right carved out of it.
+class sdf_subtraction : public sdf_node {
+public:
+    sdf_subtraction(shared_ptr<sdf_node> a, shared_ptr<sdf_node> b) : left(a), right(b) {}
+
+    virtual double distance(const point3& p) const override {
+        return fmax(left->distance(p), -right->distance(p));
+    }
+
+    virtual bool gradient(const point3& p, vec3& g) const override {
+        if (left->distance(p) > -right->distance(p))
+            return left->gradient(p, g);
+        if (!right->gradient(p, g))
+            return false;
+        g = -g;
+        return true;
+    }
+
+public:
+    shared_ptr<sdf_node> left;
+    shared_ptr<sdf_node> right;
+};
+
+// Polynomial smooth minimum; k is the width of the blend.
+class sdf_smooth_union : public sdf_node {
+public:
+    sdf_smooth_union(shared_ptr<sdf_node> a, shared_ptr<sdf_node> b, double k) : left(a), right(b), blend(k) {}
+
+    virtual double distance(const point3& p) const override {
+        auto a = left->distance(p);
+        auto b = right->distance(p);
+        auto h = clamp(0.5 + 0.5 * (b - a) / blend, 0.0, 1.0);
+        return b + (a - b) * h - blend * h * (1 - h);
+    }
+
+public:
+    shared_ptr<sdf_node> left;
+    shared_ptr<sdf_node> right;
+    double blend;
+};
+
+class sdf_translate : public sdf_node {
+public:
+    sdf_translate(shared_ptr<sdf_node> n, vec3 displacement) : child(n), offset(displacement) {}
+
+    virtual double distance(const point3& p) const override {
+        return child->distance(p - offset);
+    }
+
+    virtual bool gradient(const point3& p, vec3& g) const override {
+        return child->gradient(p - offset, g);
+    }
+
+public:
+    shared_ptr<sdf_node> child;
+    vec3 offset;
+};
+
+// The Mandelbulb, as a distance estimate from the running derivative of the orbit.
+class sdf_mandelbulb : public sdf_node {
+public:
+    sdf_mandelbulb(point3 c, double s, double p = 8, int n = 12)
+        : center(c), scale(s), power(p), iterations(n) {}
+
+    virtual double distance(const point3& p) const override {
+        auto c = (p - center) / scale;
+        auto z = c;
+        auto dr = 1.0;
+        auto r = z.length();
+
+        for (int i = 0; i < iterations && r < 2; i++) {
+            if (r < 1e-12)
+                break;
+            auto theta = acos(clamp(z.z() / r, -1.0, 1.0)) * power;
+            auto phi = atan2(z.y(), z.x()) * power;
+            dr = pow(r, power - 1) * power * dr + 1;
+            auto zr = pow(r, power);
+            z = zr * vec3(sin(theta) * cos(phi), sin(theta) * sin(phi), cos(theta)) + c;
+            r = z.length();
+        }
+
+        if (r < 1e-12)
+            return 0;
+        return 0.5 * log(r) * r / dr * scale;
+    }
+
+public:
+    point3 center;
+    double scale;
+    double power;
+    int iterations;
+};
+
+// Caches an expensive distance function over a region in bricks of brick_size^3
+// cells. Bricks the surface can't reach store a single conservative distance; the
+// others store their corner samples and interpolate trilinearly, less a bound on the
+// interpolation error, so the cache never overestimates either. Near the surface,
+// outside the region and for normals the wrapped node is evaluated directly.
+class sdf_brick_cache : public sdf_node {
+public:
+    static const int brick_size = 8;
+
+    sdf_brick_cache(shared_ptr<sdf_node> n, const aabb& region, int bricks_per_axis);
+
+    virtual double distance(const point3& p) const override;
+
+    virtual bool gradient(const point3& p, vec3& g) const override {
+        if (child->gradient(p, g))
+            return true;
+        g = sdf_tetrahedral_gradient(*child, p, 0.25 * cell_size.x());
+        return true;
+    }
+
+    size_t stored_brick_count() const { return samples.size() / brick_samples; }
+
+public:
+    shared_ptr<sdf_node> child;
+    aabb box;
+    int bricks;
+    vec3 cell_size;
+
+private:
+    static const int brick_samples = (brick_size + 1) * (brick_size + 1) * (brick_size + 1);
+
+    // Per brick: the offset of its samples, or -1 when far_distance holds for all of it.
+    std::vector<int> brick_offset;
+    std::vector<float> far_distance;
+    std::vector<float> samples;
+};
+
+sdf_brick_cache::sdf_brick_cache(shared_ptr<sdf_node> n, const aabb& region, int bricks_per_axis)
+    : child(n), box(region), bricks(bricks_per_axis)
+{
+    auto extent = box.max() - box.min();
+    cell_size = extent / (bricks * brick_size);
+    auto brick_extent = cell_size * brick_size;
+    auto half_diagonal = 0.5 * brick_extent.length();
+
+    brick_offset.assign(static_cast<size_t>(bricks) * bricks * bricks, -1);
+    far_distance.assign(brick_offset.size(), 0);
+
+    for (int bz = 0; bz < bricks; bz++) {
+        for (int by = 0; by < bricks; by++) {
+            for (int bx = 0; bx < bricks; bx++) {
+                size_t b = (static_cast<size_t>(bz) * bricks + by) * bricks + bx;
+                auto origin = box.min() + vec3(bx * brick_extent.x(), by * brick_extent.y(), bz * brick_extent.z());
+                auto d = child->distance(origin + 0.5 * brick_extent);
+
+                // Only bricks well clear of the surface are collapsed, so the bound
+                // stored for them still lets a ray take a useful step.
+                if (fabs(d) > 2 * half_diagonal) {
+                    // Every point of the brick is at least |d| - half_diagonal away.
+                    far_distance[b] = static_cast<float>(d > 0 ? d - half_diagonal : d + half_diagonal);
+                    continue;
+                }
+
+                brick_offset[b] = static_cast<int>(samples.size());
+                for (int k = 0; k <= brick_size; k++)
+                    for (int j = 0; j <= brick_size; j++)
+                        for (int i = 0; i <= brick_size; i++)
+                            samples.push_back(static_cast<float>(child->distance(
+                                origin + vec3(i * cell_size.x(), j * cell_size.y(), k * cell_size.z()))));
+            }
+        }
+    }
+}
+
+double sdf_brick_cache::distance(const point3& p) const {
+    auto g = p - box.min();
+    double c[3] = { g.x() / cell_size.x(), g.y() / cell_size.y(), g.z() / cell_size.z() };
+    const int cells = bricks * brick_size;
+    for (int a = 0; a < 3; a++)
+        if (c[a] < 0 || c[a] >= cells)
+            return child->distance(p);
+
+    int cell[3], brick[3];
+    double f[3];
+    for (int a = 0; a < 3; a++) {
+        cell[a] = static_cast<int>(c[a]);
+        brick[a] = cell[a] / brick_size;
+        f[a] = c[a] - cell[a];
+        cell[a] -= brick[a] * brick_size;
+    }
+
+    size_t b = (static_cast<size_t>(brick[2]) * bricks + brick[1]) * bricks + brick[0];
+    if (brick_offset[b] < 0)
+        return far_distance[b];
+
+    const float* s = &samples[brick_offset[b]];
+    const int row = brick_size + 1;
+    auto accum = 0.0;
+    for (int k = 0; k < 2; k++)
+        for (int j = 0; j < 2; j++)
+            for (int i = 0; i < 2; i++) {
+                auto w = (i ? f[0] : 1 - f[0]) * (j ? f[1] : 1 - f[1]) * (k ? f[2] : 1 - f[2]);
+                accum += w * s[((cell[2] + k) * row + cell[1] + j) * row + cell[0] + i];
+            }
+
+    // Each corner sample is within its distance from p of the wrapped node's value at
+    // p, so the interpolation is within the weighted mean of those distances, which is
+    // at most the root of the weighted mean of their squares: zero at the samples and
+    // half the cell diagonal at most. Shrinking towards zero by that keeps |distance|
+    // a lower bound from either side of the surface. Where that would leave less than
+    // the slack itself, p is within a few slacks of the surface and the wrapped node is
+    // asked instead, so a ray doesn't stop short of it and hits land where it puts
+    // them.
+    auto slack = sqrt(f[0] * (1 - f[0]) * cell_size.x() * cell_size.x()
+        + f[1] * (1 - f[1]) * cell_size.y() * cell_size.y()
+        + f[2] * (1 - f[2]) * cell_size.z() * cell_size.z());
+    if (accum > 2 * slack)
+        return accum - slack;
+    if (accum < -2 * slack)
+        return accum + slack;
+    return child->distance(p);
+}
+
+// A surface defined by an sdf_node, sphere traced within a bounding box. step_scale
+// below one makes the tracer safe for distance estimates that overshoot a little;
+// a ray that hasn't converged after max_steps misses.
+class sdf_shape : public hittable {
+public:
+    sdf_shape(shared_ptr<sdf_node> f, const aabb& bounds, shared_ptr<material> m,
+        int steps = 256, double step = 1.0)
+        : root(f), box(bounds), mp(m), max_steps(steps), step_scale(step) {}
+
+    virtual bool hit(
+        const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual void compute_surface_interaction(const ray& r, hit_record& rec) const override;
+
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+        output_box = box;
+        return true;
+    }
+
+public:
+    shared_ptr<sdf_node> root;
+    aabb box;
+    shared_ptr<material> mp;
+    int max_steps;
+    double step_scale;
+    double epsilon = 1e-5;
+};
+
+bool sdf_shape::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    auto t0 = t_min, t1 = t_max;
+    if (!box.clip(r, t0, t1))
+        return false;
+
+    const auto ray_length = r.direction().length();
+    auto t = t0;
+    auto d = root->distance(r.at(t));
+    int steps = 0;
+
+    // A ray leaving the surface starts within epsilon of it; nudge it off first so it
+    // doesn't hit the point it came from.
+    while (fabs(d) < epsilon && steps < max_steps) {
+        t += 2 * epsilon / ray_length;
+        d = root->distance(r.at(t));
+        steps++;
+    }
+
+    // March on |d| from whichever side the ray starts, so rays inside find the exit.
+    const double side = d < 0 ? -1 : 1;
+    for (; steps < max_steps && t <= t1; steps++) {
+        auto distance = side * d;
+        if (distance < epsilon) {
+            rec.set_deferred(this, t);
+            return true;
+        }
+        t += step_scale * distance / ray_length;
+        d = root->distance(r.at(t));
+    }
+
+    return false;
+}
+
+void sdf_shape::compute_surface_interaction(const ray& r, hit_record& rec) const {
+    rec.p = r.at(rec.t);
+
+    vec3 g;
+    if (!root->gradient(rec.p, g))
+        g = sdf_tetrahedral_gradient(*root, rec.p, 10 * epsilon);
+    rec.set_face_normal(r, unit_vector(g));
+    rec.u = 0;
+    rec.v = 0;
+    rec.mat_ptr = mp.get();
+}
+
+#endif
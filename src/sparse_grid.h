@@ -0,0 +1,399 @@
+#ifndef SPARSE_GRID_H
+#define SPARSE_GRID_H
+
+#include "rtweekend.h"
+#include "aabb.h"
+#include "mapped_file.h"
+#include "volume_grid.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <vector>
+
+// A read-only sparse voxel grid in the spirit of NanoVDB: a sorted root table of
+// internal nodes, each covering 16^3 leaves, each leaf an 8^3 brick with an active
+// mask. Only occupied leaves are stored. The file layout is the in-memory layout, so
+// a grid is used straight from a memory mapping and only the bricks rays actually
+// reach are paged in.
+//
+// Voxel (i, j, k) is centered at origin + (i + 0.5, j + 0.5, k + 0.5) * voxel_size,
+// matching dense_grid. Inactive voxels read as zero.
+class sparse_grid : public volume_grid {
+public:
+    static const uint32_t file_magic = 0x584f5653;  // "SVOX"
+    static const uint32_t file_version = 2;
+
+    struct leaf_node {
+        int32_t origin[3];
+        float max_value;
+        uint64_t value_mask[8];
+        float values[512];
+    };
+
+    struct internal_node {
+        int32_t origin[3];
+        float max_value;
+        uint64_t child_mask[64];
+        uint32_t child[4096];
+        float child_max[4096];  // max_value of each child, so bounds don't touch leaves
+    };
+
+    struct root_entry {
+        int32_t origin[3];
+        uint32_t internal;
+    };
+
+    struct file_header {
+        uint32_t magic;
+        uint32_t version;
+        float origin[3];
+        float voxel_size[3];
+        int32_t index_min[3];
+        int32_t index_max[3];
+        uint32_t root_count;
+        uint32_t internal_count;
+        uint32_t leaf_count;
+        uint32_t padding;
+    };
+
+    sparse_grid() {}
+
+    // Maps the file and validates its header, root table and internal nodes. Returns
+    // false, leaving an empty grid, if the file cannot be used.
+    bool load(const char* filename);
+
+    virtual double density(const point3& p) const override {
+        cache c;
+        return cached_density(p, c);
+    }
+
+    virtual double cached_density(const point3& p, cache& c) const override;
+    virtual double max_density(const aabb& region) const override;
+    virtual aabb bounds() const override;
+
+    // Value of a single voxel, reusing the leaf found by the previous lookup when the
+    // voxel lies in the same brick.
+    float value(int x, int y, int z, cache& c) const;
+
+    size_t leaf_count() const { return header ? header->leaf_count : 0; }
+
+private:
+    const leaf_node* find_leaf(int x, int y, int z) const;
+    const internal_node* find_internal(int x, int y, int z) const;
+
+    static bool less(const int32_t* a, const int32_t* b) {
+        if (a[2] != b[2]) return a[2] < b[2];
+        if (a[1] != b[1]) return a[1] < b[1];
+        return a[0] < b[0];
+    }
+
+private:
+    mapped_file file;
+    const file_header* header = nullptr;
+    const root_entry* roots = nullptr;
+    const internal_node* internals = nullptr;
+    const leaf_node* leaves = nullptr;
+    vec3 origin;
+    vec3 voxel_size;
+};
+
+bool sparse_grid::load(const char* filename) {
+    header = nullptr;
+    if (!file.open(filename))
+        return false;
+
+    auto h = reinterpret_cast<const file_header*>(file.data());
+    if (file.size() < sizeof(file_header) || h->magic != file_magic || h->version != file_version) {
+        std::cerr << "ERROR: '" << filename << "' is not a sparse grid file.\n";
+        file.close();
+        return false;
+    }
+
+    size_t expected = sizeof(file_header)
+        + h->root_count * sizeof(root_entry)
+        + h->internal_count * sizeof(internal_node)
+        + h->leaf_count * sizeof(leaf_node);
+    if (file.size() < expected) {
+        std::cerr << "ERROR: Sparse grid file '" << filename << "' is truncated.\n";
+        file.close();
+        return false;
+    }
+
+    auto bytes = file.data() + sizeof(file_header);
+    auto r = reinterpret_cast<const root_entry*>(bytes);
+    bytes += h->root_count * sizeof(root_entry);
+    auto n = reinterpret_cast<const internal_node*>(bytes);
+    bytes += h->internal_count * sizeof(internal_node);
+
+    // Every index must stay inside the file, and the roots must be sorted for the
+    // binary search. Leaves aren't read here, so they are still paged in on demand.
+    bool valid = true;
+    for (uint32_t i = 0; i < h->root_count && valid; i++) {
+        valid = r[i].internal < h->internal_count
+            && (i == 0 || less(r[i - 1].origin, r[i].origin))
+            && std::equal(r[i].origin, r[i].origin + 3, n[r[i].internal].origin);
+    }
+    for (uint32_t i = 0; i < h->internal_count && valid; i++) {
+        for (int slot = 0; slot < 4096 && valid; slot++) {
+            if (n[i].child_mask[slot >> 6] & (uint64_t(1) << (slot & 63)))
+                valid = n[i].child[slot] < h->leaf_count;
+        }
+    }
+    if (!valid) {
+        std::cerr << "ERROR: Sparse grid file '" << filename << "' is corrupt.\n";
+        file.close();
+        return false;
+    }
+
+    header = h;
+    roots = r;
+    internals = n;
+    leaves = reinterpret_cast<const leaf_node*>(bytes);
+
+    origin = vec3(h->origin[0], h->origin[1], h->origin[2]);
+    voxel_size = vec3(h->voxel_size[0], h->voxel_size[1], h->voxel_size[2]);
+    return true;
+}
+
+const sparse_grid::internal_node* sparse_grid::find_internal(int x, int y, int z) const {
+    int32_t key[3] = { x & ~127, y & ~127, z & ~127 };
+    auto end = roots + header->root_count;
+    auto it = std::lower_bound(roots, end, key,
+        [](const root_entry& e, const int32_t* k) { return less(e.origin, k); });
+
+    if (it == end || less(key, it->origin))
+        return nullptr;
+    return &internals[it->internal];
+}
+
+const sparse_grid::leaf_node* sparse_grid::find_leaf(int x, int y, int z) const {
+    auto node = find_internal(x, y, z);
+    if (node == nullptr)
+        return nullptr;
+
+    int slot = (((z >> 3) & 15) * 16 + ((y >> 3) & 15)) * 16 + ((x >> 3) & 15);
+    if (!(node->child_mask[slot >> 6] & (uint64_t(1) << (slot & 63))))
+        return nullptr;
+    return &leaves[node->child[slot]];
+}
+
+float sparse_grid::value(int x, int y, int z, cache& c) const {
+    int ox = x & ~7, oy = y & ~7, oz = z & ~7;
+    if (!c.valid || c.origin[0] != ox || c.origin[1] != oy || c.origin[2] != oz) {
+        c.leaf = header ? find_leaf(x, y, z) : nullptr;
+        c.origin[0] = ox;
+        c.origin[1] = oy;
+        c.origin[2] = oz;
+        c.valid = true;
+    }
+
+    if (c.leaf == nullptr)
+        return 0;
+
+    auto leaf = static_cast<const leaf_node*>(c.leaf);
+    return leaf->values[((z & 7) * 8 + (y & 7)) * 8 + (x & 7)];
+}
+
+double sparse_grid::cached_density(const point3& p, cache& c) const {
+    auto gx = (p.x() - origin.x()) / voxel_size.x() - 0.5;
+    auto gy = (p.y() - origin.y()) / voxel_size.y() - 0.5;
+    auto gz = (p.z() - origin.z()) / voxel_size.z() - 0.5;
+
+    auto x0 = static_cast<int>(floor(gx));
+    auto y0 = static_cast<int>(floor(gy));
+    auto z0 = static_cast<int>(floor(gz));
+    auto fx = gx - x0;
+    auto fy = gy - y0;
+    auto fz = gz - z0;
+
+    auto accum = 0.0;
+    for (int k = 0; k < 2; k++)
+        for (int j = 0; j < 2; j++)
+            for (int i = 0; i < 2; i++)
+                accum += (i * fx + (1 - i) * (1 - fx))
+                    * (j * fy + (1 - j) * (1 - fy))
+                    * (k * fz + (1 - k) * (1 - fz))
+                    * value(x0 + i, y0 + j, z0 + k, c);
+
+    return accum;
+}
+
+double sparse_grid::max_density(const aabb& region) const {
+    if (header == nullptr)
+        return 0;
+
+    // Index range touched by trilinear lookups inside the region.
+    int lo[3], hi[3];
+    for (int a = 0; a < 3; a++) {
+        lo[a] = static_cast<int>(floor((region.min()[a] - origin[a]) / voxel_size[a])) - 1;
+        hi[a] = static_cast<int>(floor((region.max()[a] - origin[a]) / voxel_size[a])) + 1;
+    }
+
+    float result = 0;
+    for (uint32_t r = 0; r < header->root_count; r++) {
+        const auto& node = internals[roots[r].internal];
+        bool overlaps = true;
+        for (int a = 0; a < 3; a++)
+            overlaps = overlaps && node.origin[a] <= hi[a] && node.origin[a] + 127 >= lo[a];
+        if (!overlaps || node.max_value <= result)
+            continue;
+
+        // Only the children whose bricks overlap the index range.
+        int first[3], last[3];
+        for (int a = 0; a < 3; a++) {
+            first[a] = std::max(0, (lo[a] - node.origin[a]) >> 3);
+            last[a] = std::min(15, (hi[a] - node.origin[a]) >> 3);
+        }
+
+        for (int z = first[2]; z <= last[2]; z++) {
+            for (int y = first[1]; y <= last[1]; y++) {
+                for (int x = first[0]; x <= last[0]; x++) {
+                    int slot = (z * 16 + y) * 16 + x;
+                    if (node.child_mask[slot >> 6] & (uint64_t(1) << (slot & 63)))
+                        result = std::max(result, node.child_max[slot]);
+                }
+            }
+        }
+    }
+
+    return result;
+}
+
+aabb sparse_grid::bounds() const {
+    if (header == nullptr)
+        return aabb(point3(0, 0, 0), point3(0, 0, 0));
+
+    point3 lo, hi;
+    for (int a = 0; a < 3; a++) {
+        lo[a] = origin[a] + header->index_min[a] * voxel_size[a];
+        hi[a] = origin[a] + (header->index_max[a] + 1) * voxel_size[a];
+    }
+    return aabb(lo, hi);
+}
+
+// Collects active voxels and writes them in the sparse_grid file format. Only leaves
+// that receive a nonzero value are allocated.
+class sparse_grid_builder {
+public:
+    sparse_grid_builder(const point3& _origin, const vec3& _voxel_size)
+        : origin(_origin), voxel_size(_voxel_size) {}
+
+    void set(int x, int y, int z, float v);
+    bool write(const char* filename) const;
+
+private:
+    using key = std::array<int32_t, 3>;
+
+    struct key_less {
+        bool operator()(const key& a, const key& b) const {
+            if (a[2] != b[2]) return a[2] < b[2];
+            if (a[1] != b[1]) return a[1] < b[1];
+            return a[0] < b[0];
+        }
+    };
+
+    point3 origin;
+    vec3 voxel_size;
+    std::map<key, sparse_grid::leaf_node, key_less> leaves;
+};
+
+void sparse_grid_builder::set(int x, int y, int z, float v) {
+    if (v == 0)
+        return;
+
+    key k = { x & ~7, y & ~7, z & ~7 };
+    auto it = leaves.find(k);
+    if (it == leaves.end()) {
+        sparse_grid::leaf_node leaf;
+        std::memset(&leaf, 0, sizeof(leaf));
+        for (int a = 0; a < 3; a++)
+            leaf.origin[a] = k[a];
+        it = leaves.emplace(k, leaf).first;
+    }
+
+    auto& leaf = it->second;
+    int index = ((z & 7) * 8 + (y & 7)) * 8 + (x & 7);
+    leaf.values[index] = v;
+    leaf.value_mask[index >> 6] |= uint64_t(1) << (index & 63);
+    leaf.max_value = std::max(leaf.max_value, v);
+}
+
+bool sparse_grid_builder::write(const char* filename) const {
+    std::vector<sparse_grid::root_entry> roots;
+    std::vector<sparse_grid::internal_node> internals;
+
+    sparse_grid::file_header h;
+    std::memset(&h, 0, sizeof(h));
+    h.magic = sparse_grid::file_magic;
+    h.version = sparse_grid::file_version;
+    for (int a = 0; a < 3; a++) {
+        h.origin[a] = static_cast<float>(origin[a]);
+        h.voxel_size[a] = static_cast<float>(voxel_size[a]);
+        h.index_min[a] = leaves.empty() ? 0 : INT32_MAX;
+        h.index_max[a] = leaves.empty() ? 0 : INT32_MIN;
+    }
+
+    // Leaves are ordered by z, y, x, which interleaves the leaves of neighbouring
+    // internal nodes, so internal nodes are found by key rather than by position.
+    std::map<key, uint32_t, key_less> internal_index;
+    uint32_t leaf_index = 0;
+    for (const auto& entry : leaves) {
+        const auto& leaf = entry.second;
+        key ik = { leaf.origin[0] & ~127, leaf.origin[1] & ~127, leaf.origin[2] & ~127 };
+
+        auto it = internal_index.find(ik);
+        if (it == internal_index.end()) {
+            sparse_grid::internal_node node;
+            std::memset(&node, 0, sizeof(node));
+            for (int a = 0; a < 3; a++)
+                node.origin[a] = ik[a];
+            internals.push_back(node);
+            it = internal_index.emplace(ik, static_cast<uint32_t>(internals.size() - 1)).first;
+        }
+
+        auto& node = internals[it->second];
+        int slot = (((leaf.origin[2] >> 3) & 15) * 16 + ((leaf.origin[1] >> 3) & 15)) * 16
+            + ((leaf.origin[0] >> 3) & 15);
+        node.child_mask[slot >> 6] |= uint64_t(1) << (slot & 63);
+        node.child[slot] = leaf_index++;
+        node.child_max[slot] = leaf.max_value;
+        node.max_value = std::max(node.max_value, leaf.max_value);
+
+        for (int a = 0; a < 3; a++) {
+            h.index_min[a] = std::min(h.index_min[a], leaf.origin[a]);
+            h.index_max[a] = std::max(h.index_max[a], leaf.origin[a] + 7);
+        }
+    }
+
+    for (const auto& entry : internal_index) {
+        sparse_grid::root_entry e;
+        for (int a = 0; a < 3; a++)
+            e.origin[a] = entry.first[a];
+        e.internal = entry.second;
+        roots.push_back(e);
+    }
+
+    h.root_count = static_cast<uint32_t>(roots.size());
+    h.internal_count = static_cast<uint32_t>(internals.size());
+    h.leaf_count = leaf_index;
+
+    std::ofstream out(filename, std::ios::binary);
+    if (!out) {
+        std::cerr << "ERROR: Could not write sparse grid file '" << filename << "'.\n";
+        return false;
+    }
+
+    out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+    out.write(reinterpret_cast<const char*>(roots.data()), roots.size() * sizeof(roots[0]));
+    out.write(reinterpret_cast<const char*>(internals.data()), internals.size() * sizeof(internals[0]));
+    for (const auto& entry : leaves)
+        out.write(reinterpret_cast<const char*>(&entry.second), sizeof(entry.second));
+
+    return static_cast<bool>(out);
+}
+
+#endif
@@ -14,13 +14,24 @@ public:
     virtual bool hit(
         const ray& r, double t_min, double t_max, hit_record& rec) const override;
     virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+    virtual void compute_surface_interaction(const ray& r, hit_record& rec) const override;
+    virtual bool hit_interval(const ray& r, double& t_enter, double& t_exit) const override;
     virtual double sphere::pdf_value(const point3& o, const vec3& v) const override;
     virtual vec3 sphere::random(const point3& o) const override;
+
+    virtual double surface_area() const override {
+        return 4 * pi * radius * radius;
+    }
+
+    virtual void find_lights(
+        const shared_ptr<hittable>& self, bool flipped, std::vector<light_candidate>& out) const override {
+        out.push_back({ self, mat_ptr.get(), vec3(0, 0, 1), -1 });
+    }
 public:
     point3 center;
     double radius;
     shared_ptr<material> mat_ptr;
-private:
+
     static void get_sphere_uv(const point3& p, double& u, double& v) {
         // p: a given point on the sphere of radius one, centered at the origin.
         // u: returned value [0,1] of angle around the Y axis from X=-1.
@@ -55,13 +66,30 @@ bool sphere::hit(const ray& r, double t_min, double t_max, hit_record& rec) cons
             return false;
     }
 
-    rec.t = root;
+    rec.set_deferred(this, root);
+    return true;
+}
+
+void sphere::compute_surface_interaction(const ray& r, hit_record& rec) const {
     rec.p = r.at(rec.t);
     vec3 outward_normal = (rec.p - center) / radius;
     rec.set_face_normal(r, outward_normal);
     get_sphere_uv(outward_normal, rec.u, rec.v);
-    rec.mat_ptr = mat_ptr;
+    rec.mat_ptr = mat_ptr.get();
+}
 
+bool sphere::hit_interval(const ray& r, double& t_enter, double& t_exit) const {
+    vec3 oc = r.origin() - center;
+    auto a = r.direction().length_squared();
+    auto half_b = dot(oc, r.direction());
+    auto c = oc.length_squared() - radius * radius;
+
+    auto discriminant = half_b * half_b - a * c;
+    if (discriminant <= 0) return false;
+    auto sqrtd = sqrt(discriminant);
+
+    t_enter = (-half_b - sqrtd) / a;
+    t_exit = (-half_b + sqrtd) / a;
     return true;
 }
 
@@ -73,11 +101,18 @@ bool sphere::bounding_box(double time0, double time1, aabb& output_box) const {
 }
 
 double sphere::pdf_value(const point3& o, const vec3& v) const {
-    hit_record rec;
-    if (!this->hit(ray(o, v), 0.001, infinity, rec))
+    // The direction reaches the sphere exactly when it lies inside the cone that
+    // random() samples, so a cosine test replaces the intersection.
+    vec3 direction = center - o;
+    auto distance_squared = direction.length_squared();
+    if (distance_squared <= radius * radius)
+        return 0;
+
+    auto cos_theta_max = sqrt(1 - radius * radius / distance_squared);
+    auto cosine = dot(direction, v) / sqrt(distance_squared * v.length_squared());
+    if (cosine < cos_theta_max)
         return 0;
 
-    auto cos_theta_max = sqrt(1 - radius * radius / (center - o).length_squared());
     auto solid_angle = 2 * pi * (1 - cos_theta_max);
 
     return  1 / solid_angle;
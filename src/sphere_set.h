@@ -0,0 +1,350 @@
+#ifndef SPHERE_SET_H
+#define SPHERE_SET_H
+
+#include "rtweekend.h"
+#include "hittable.h"
+#include "sphere.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <vector>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+// A large set of spheres stored as structure-of-arrays: float center and radius plus
+// a 16-bit material index, 18 bytes per sphere, instead of a full sphere object with
+// its vtable and shared_ptr<material>. The set carries its own BVH whose leaves
+// reference runs of leaf_size consecutive spheres, intersected eight at a time with an
+// AVX2 kernel. Splits fall on multiples of leaf_size, so every leaf but the last is
+// full and the 32-byte nodes come to one per eight spheres: about 22 bytes per sphere
+// in all.
+class sphere_set : public hittable {
+public:
+    static const int leaf_size = 16;
+
+    sphere_set() {}
+
+    int add_material(shared_ptr<material> m) {
+        materials.push_back(m);
+        return static_cast<int>(materials.size() - 1);
+    }
+
+    // Spheres whose material index doesn't fit the 16-bit table are reported and dropped.
+    void add(const point3& center, double r, int material_index) {
+        if (material_index < 0 || material_index > std::numeric_limits<uint16_t>::max()) {
+            std::cerr << "ERROR: sphere_set material index " << material_index << " is out of range.\n";
+            return;
+        }
+
+        cx.push_back(static_cast<float>(center.x()));
+        cy.push_back(static_cast<float>(center.y()));
+        cz.push_back(static_cast<float>(center.z()));
+        radius.push_back(static_cast<float>(r));
+        mat_index.push_back(static_cast<uint16_t>(material_index));
+    }
+
+    size_t size() const { return count; }
+
+    // Builds the BVH and reorders the sphere arrays into leaf order. Must be called
+    // after the last add() and before rendering.
+    void build();
+
+    virtual bool hit(
+        const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+    virtual void compute_surface_interaction(const ray& r, hit_record& rec) const override;
+
+public:
+    struct node {
+        float bmin[3];
+        float bmax[3];
+        uint32_t offset;    // first sphere for leaves, right child for interior nodes
+        uint16_t count;     // number of spheres, zero for interior nodes
+        uint16_t axis;      // split axis, used to order the children during traversal
+    };
+
+    std::vector<float> cx, cy, cz, radius;
+    std::vector<uint16_t> mat_index;
+    std::vector<shared_ptr<material>> materials;
+    std::vector<node> nodes;
+    size_t count = 0;
+
+private:
+    int build_recursive(std::vector<uint32_t>& order, size_t start, size_t end);
+    void intersect_leaf(const node& n, const ray& r, double t_min, double& closest, int& hit_index) const;
+    bool intersect_one(size_t i, const ray& r, double t_min, double t_max, double& t) const;
+};
+
+void sphere_set::build() {
+    count = cx.size();
+    nodes.clear();
+    if (count == 0)
+        return;
+
+    std::vector<uint32_t> order(count);
+    for (size_t i = 0; i < count; i++)
+        order[i] = static_cast<uint32_t>(i);
+
+    nodes.reserve(2 * (count / leaf_size + 1));
+    build_recursive(order, 0, count);
+
+    auto permute = [&](auto& v) {
+        auto old = v;
+        for (size_t i = 0; i < count; i++)
+            v[i] = old[order[i]];
+    };
+    permute(cx);
+    permute(cy);
+    permute(cz);
+    permute(radius);
+    permute(mat_index);
+
+    // Pad every array so the vector kernel may always load a full leaf_size lanes.
+    // Padded spheres have a negative radius and are never reported as hits.
+    cx.resize(count + leaf_size, 0.0f);
+    cy.resize(count + leaf_size, 0.0f);
+    cz.resize(count + leaf_size, 0.0f);
+    radius.resize(count + leaf_size, -1.0f);
+    mat_index.resize(count + leaf_size, 0);
+}
+
+int sphere_set::build_recursive(std::vector<uint32_t>& order, size_t start, size_t end) {
+    int index = static_cast<int>(nodes.size());
+    nodes.push_back(node());
+
+    const float inf = std::numeric_limits<float>::infinity();
+    float bmin[3] = { inf, inf, inf };
+    float bmax[3] = { -inf, -inf, -inf };
+    float cmin[3] = { inf, inf, inf };
+    float cmax[3] = { -inf, -inf, -inf };
+
+    for (size_t i = start; i < end; i++) {
+        auto s = order[i];
+        float c[3] = { cx[s], cy[s], cz[s] };
+        for (int a = 0; a < 3; a++) {
+            bmin[a] = std::min(bmin[a], c[a] - radius[s]);
+            bmax[a] = std::max(bmax[a], c[a] + radius[s]);
+            cmin[a] = std::min(cmin[a], c[a]);
+            cmax[a] = std::max(cmax[a], c[a]);
+        }
+    }
+
+    for (int a = 0; a < 3; a++) {
+        nodes[index].bmin[a] = bmin[a];
+        nodes[index].bmax[a] = bmax[a];
+    }
+
+    if (end - start <= leaf_size) {
+        nodes[index].offset = static_cast<uint32_t>(start);
+        nodes[index].count = static_cast<uint16_t>(end - start);
+        nodes[index].axis = 0;
+        return index;
+    }
+
+    // Split near the median center along the longest axis of the centroid bounds, at
+    // a multiple of leaf_size so the leaves come out full.
+    int axis = 0;
+    for (int a = 1; a < 3; a++)
+        if (cmax[a] - cmin[a] > cmax[axis] - cmin[axis])
+            axis = a;
+
+    const auto& key = (axis == 0) ? cx : (axis == 1) ? cy : cz;
+    auto mid = start + (end - start + leaf_size - 1) / leaf_size / 2 * leaf_size;
+    std::nth_element(order.begin() + start, order.begin() + mid, order.begin() + end,
+        [&](uint32_t a, uint32_t b) { return key[a] < key[b]; });
+
+    build_recursive(order, start, mid);
+    int right = build_recursive(order, mid, end);
+
+    nodes[index].offset = static_cast<uint32_t>(right);
+    nodes[index].count = 0;
+    nodes[index].axis = static_cast<uint16_t>(axis);
+    return index;
+}
+
+bool sphere_set::intersect_one(size_t i, const ray& r, double t_min, double t_max, double& t) const {
+    vec3 oc = r.origin() - point3(cx[i], cy[i], cz[i]);
+    auto a = r.direction().length_squared();
+    auto half_b = dot(oc, r.direction());
+    auto c = oc.length_squared() - static_cast<double>(radius[i]) * radius[i];
+
+    auto discriminant = half_b * half_b - a * c;
+    if (discriminant < 0 || radius[i] < 0) return false;
+    auto sqrtd = sqrt(discriminant);
+
+    auto root = (-half_b - sqrtd) / a;
+    if (root < t_min || t_max < root) {
+        root = (-half_b + sqrtd) / a;
+        if (root < t_min || t_max < root)
+            return false;
+    }
+
+    t = root;
+    return true;
+}
+
+void sphere_set::intersect_leaf(
+    const node& n, const ray& r, double t_min, double& closest, int& hit_index
+) const {
+#ifdef __AVX2__
+    // Single precision prefilter of eight lanes at once; the lanes it keeps are
+    // then intersected in double precision, so the reported t matches sphere::hit.
+    // The prefilter must never drop a true hit. It measures the distance from each
+    // center to the closest point of the ray, which doesn't cancel the way
+    // |oc|^2 - r^2 does when small spheres are seen from far away, and widens the
+    // radius and the t range by a bound on the float rounding. That error grows with
+    // the magnitude of the coordinates involved.
+    const auto& o = r.origin();
+    const auto& d = r.direction();
+    double scale = fmax(fabs(o.x()), fmax(fabs(o.y()), fabs(o.z())));
+    for (int a = 0; a < 3; a++)
+        scale = fmax(scale, fmax(fabs(n.bmin[a]), fabs(n.bmax[a])));
+    auto err = static_cast<float>(4e-6 * scale);
+    auto inv_length = static_cast<float>(1 / d.length());
+
+    auto ox = _mm256_set1_ps(static_cast<float>(o.x()));
+    auto oy = _mm256_set1_ps(static_cast<float>(o.y()));
+    auto oz = _mm256_set1_ps(static_cast<float>(o.z()));
+    auto dx = _mm256_set1_ps(static_cast<float>(d.x()));
+    auto dy = _mm256_set1_ps(static_cast<float>(d.y()));
+    auto dz = _mm256_set1_ps(static_cast<float>(d.z()));
+    auto inv_a = _mm256_set1_ps(static_cast<float>(1 / d.length_squared()));
+    auto lo = _mm256_set1_ps(static_cast<float>(t_min));
+
+    for (uint32_t first = n.offset; first < n.offset + n.count; first += 8) {
+        auto hi = _mm256_set1_ps(static_cast<float>(closest));
+
+        auto ocx = _mm256_sub_ps(ox, _mm256_loadu_ps(&cx[first]));
+        auto ocy = _mm256_sub_ps(oy, _mm256_loadu_ps(&cy[first]));
+        auto ocz = _mm256_sub_ps(oz, _mm256_loadu_ps(&cz[first]));
+        auto rad = _mm256_loadu_ps(&radius[first]);
+
+        // Parameter of the point of the ray closest to the center, and its offset from it.
+        auto half_b = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(ocx, dx), _mm256_mul_ps(ocy, dy)),
+            _mm256_mul_ps(ocz, dz));
+        auto tc = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_mul_ps(half_b, inv_a));
+        auto vx = _mm256_add_ps(ocx, _mm256_mul_ps(tc, dx));
+        auto vy = _mm256_add_ps(ocy, _mm256_mul_ps(tc, dy));
+        auto vz = _mm256_add_ps(ocz, _mm256_mul_ps(tc, dz));
+        auto v2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(vx, vx), _mm256_mul_ps(vy, vy)), _mm256_mul_ps(vz, vz));
+
+        // disc = r^2 - |v|^2 with the radius widened by the error bound.
+        auto wide = _mm256_add_ps(rad, _mm256_set1_ps(err));
+        auto disc = _mm256_sub_ps(_mm256_mul_ps(wide, wide), v2);
+        auto half_chord = _mm256_sqrt_ps(_mm256_mul_ps(_mm256_max_ps(disc, _mm256_setzero_ps()), inv_a));
+
+        // The chord's t range, widened by the same error in t plus the rounding of tc.
+        auto margin = _mm256_add_ps(_mm256_set1_ps(2 * err * inv_length),
+            _mm256_mul_ps(_mm256_set1_ps(1e-6f), _mm256_andnot_ps(_mm256_set1_ps(-0.0f), tc)));
+        auto t_enter = _mm256_sub_ps(_mm256_sub_ps(tc, half_chord), margin);
+        auto t_exit = _mm256_add_ps(_mm256_add_ps(tc, half_chord), margin);
+
+        auto valid = _mm256_and_ps(
+            _mm256_and_ps(_mm256_cmp_ps(disc, _mm256_setzero_ps(), _CMP_GE_OQ),
+                _mm256_cmp_ps(rad, _mm256_setzero_ps(), _CMP_GE_OQ)),
+            _mm256_and_ps(_mm256_cmp_ps(t_exit, lo, _CMP_GE_OQ), _mm256_cmp_ps(t_enter, hi, _CMP_LE_OQ)));
+        int lanes = std::min<int>(8, n.offset + n.count - first);
+        int mask = _mm256_movemask_ps(valid) & ((1 << lanes) - 1);
+
+        // Over-accepted lanes are rejected here.
+        while (mask) {
+            int lane = 0;
+            while (!(mask & (1 << lane)))
+                lane++;
+            mask &= ~(1 << lane);
+
+            double root;
+            if (intersect_one(first + lane, r, t_min, closest, root)) {
+                closest = root;
+                hit_index = static_cast<int>(first + lane);
+            }
+        }
+    }
+#else
+    for (size_t i = n.offset; i < n.offset + n.count; i++) {
+        double root;
+        if (intersect_one(i, r, t_min, closest, root)) {
+            closest = root;
+            hit_index = static_cast<int>(i);
+        }
+    }
+#endif
+}
+
+bool sphere_set::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    if (nodes.empty())
+        return false;
+
+    double inv_dir[3] = { 1 / r.direction().x(), 1 / r.direction().y(), 1 / r.direction().z() };
+    double closest = t_max;
+    int hit_index = -1;
+
+    int stack[64];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+
+    while (stack_size > 0) {
+        const node& n = nodes[stack[--stack_size]];
+
+        auto lo = t_min;
+        auto hi = closest;
+        bool miss = false;
+        for (int a = 0; a < 3 && !miss; a++) {
+            auto t0 = (n.bmin[a] - r.origin()[a]) * inv_dir[a];
+            auto t1 = (n.bmax[a] - r.origin()[a]) * inv_dir[a];
+            if (inv_dir[a] < 0)
+                std::swap(t0, t1);
+            lo = t0 > lo ? t0 : lo;
+            hi = t1 < hi ? t1 : hi;
+            miss = hi < lo;
+        }
+        if (miss)
+            continue;
+
+        if (n.count > 0) {
+            intersect_leaf(n, r, t_min, closest, hit_index);
+            continue;
+        }
+
+        // Push the far child first so the near child is visited first.
+        int near_child = static_cast<int>(&n - &nodes[0]) + 1;
+        int far_child = static_cast<int>(n.offset);
+        if (inv_dir[n.axis] < 0)
+            std::swap(near_child, far_child);
+        stack[stack_size++] = far_child;
+        stack[stack_size++] = near_child;
+    }
+
+    if (hit_index < 0)
+        return false;
+
+    rec.set_deferred(this, closest, hit_index);
+    return true;
+}
+
+void sphere_set::compute_surface_interaction(const ray& r, hit_record& rec) const {
+    auto i = rec.prim_id;
+    point3 center(cx[i], cy[i], cz[i]);
+    rec.p = r.at(rec.t);
+    vec3 outward_normal = (rec.p - center) / radius[i];
+    rec.set_face_normal(r, outward_normal);
+    sphere::get_sphere_uv(outward_normal, rec.u, rec.v);
+    rec.mat_ptr = materials[mat_index[i]].get();
+}
+
+bool sphere_set::bounding_box(double time0, double time1, aabb& output_box) const {
+    if (nodes.empty())
+        return false;
+
+    const node& root = nodes[0];
+    output_box = aabb(
+        point3(root.bmin[0], root.bmin[1], root.bmin[2]),
+        point3(root.bmax[0], root.bmax[1], root.bmax[2]));
+    return true;
+}
+
+#endif
@@ -0,0 +1,353 @@
+#ifndef SUBDIVISION_SURFACE_H
+#define SUBDIVISION_SURFACE_H
+
+#include "rtweekend.h"
+
+#include "bvh.h"
+#include "geometry_cache.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "triangle_mesh.h"
+
+#include <algorithm>
+#include <map>
+#include <utility>
+#include <vector>
+
+// A polygon mesh stored as flat vertex lists, face f using
+// face_vertices[face_start[f]] .. face_vertices[face_start[f + 1] - 1].
+struct poly_mesh {
+    std::vector<point3> positions;
+    std::vector<int> face_start{ 0 };
+    std::vector<int> face_vertices;
+
+    int face_count() const { return static_cast<int>(face_start.size()) - 1; }
+    int face_size(int f) const { return face_start[f + 1] - face_start[f]; }
+    int vertex(int f, int i) const { return face_vertices[face_start[f] + i]; }
+
+    void add_face(std::initializer_list<int> vertices) {
+        face_vertices.insert(face_vertices.end(), vertices);
+        face_start.push_back(static_cast<int>(face_vertices.size()));
+    }
+};
+
+// One Catmull-Clark step. Every output face is a quad; parent[i] is the input face
+// output face i came from. Open edges use the boundary rules (midpoint edges, corner
+// vertices weighted 3/4 with their two boundary neighbours at 1/8).
+inline poly_mesh catmull_clark(const poly_mesh& in, std::vector<int>& parent) {
+    const int vertex_count = static_cast<int>(in.positions.size());
+    const int face_count = in.face_count();
+
+    struct edge_info {
+        int v0, v1;
+        int faces = 0;
+        vec3 face_sum;
+    };
+    std::map<std::pair<int, int>, int> edge_index;
+    std::vector<edge_info> edges;
+
+    std::vector<point3> face_points(face_count);
+    std::vector<int> face_edges(in.face_vertices.size());
+    for (int f = 0; f < face_count; f++) {
+        int n = in.face_size(f);
+        vec3 centroid(0, 0, 0);
+        for (int i = 0; i < n; i++)
+            centroid += in.positions[in.vertex(f, i)];
+        face_points[f] = centroid / n;
+
+        for (int i = 0; i < n; i++) {
+            int a = in.vertex(f, i);
+            int b = in.vertex(f, (i + 1) % n);
+            auto k = std::make_pair(std::min(a, b), std::max(a, b));
+            auto found = edge_index.find(k);
+            int e;
+            if (found == edge_index.end()) {
+                e = static_cast<int>(edges.size());
+                edge_index[k] = e;
+                edges.push_back(edge_info{ k.first, k.second, 0, vec3(0, 0, 0) });
+            }
+            else {
+                e = found->second;
+            }
+            edges[e].faces++;
+            edges[e].face_sum += face_points[f];
+            face_edges[in.face_start[f] + i] = e;
+        }
+    }
+
+    // Vertex points.
+    std::vector<vec3> face_sum(vertex_count, vec3(0, 0, 0));
+    std::vector<int> valence(vertex_count, 0);
+    std::vector<vec3> edge_sum(vertex_count, vec3(0, 0, 0));
+    std::vector<int> edge_count(vertex_count, 0);
+    std::vector<vec3> boundary_sum(vertex_count, vec3(0, 0, 0));
+    std::vector<int> boundary_count(vertex_count, 0);
+
+    for (int f = 0; f < face_count; f++) {
+        for (int i = 0; i < in.face_size(f); i++) {
+            face_sum[in.vertex(f, i)] += face_points[f];
+            valence[in.vertex(f, i)]++;
+        }
+    }
+    for (const auto& e : edges) {
+        auto mid = 0.5 * (in.positions[e.v0] + in.positions[e.v1]);
+        edge_sum[e.v0] += mid;
+        edge_sum[e.v1] += mid;
+        edge_count[e.v0]++;
+        edge_count[e.v1]++;
+        if (e.faces == 1) {
+            boundary_sum[e.v0] += in.positions[e.v1];
+            boundary_sum[e.v1] += in.positions[e.v0];
+            boundary_count[e.v0]++;
+            boundary_count[e.v1]++;
+        }
+    }
+
+    poly_mesh out;
+    out.positions.resize(vertex_count + face_count + edges.size());
+    for (int v = 0; v < vertex_count; v++) {
+        const auto& p = in.positions[v];
+        if (boundary_count[v] == 2) {
+            out.positions[v] = 0.75 * p + 0.125 * boundary_sum[v];
+        }
+        else if (boundary_count[v] > 0 || valence[v] < 3) {
+            out.positions[v] = p;
+        }
+        else {
+            double n = edge_count[v];
+            out.positions[v] = (face_sum[v] / valence[v] + 2 * edge_sum[v] / n + (n - 3) * p) / n;
+        }
+    }
+    for (int f = 0; f < face_count; f++)
+        out.positions[vertex_count + f] = face_points[f];
+    for (size_t e = 0; e < edges.size(); e++) {
+        const auto& edge = edges[e];
+        auto mid = 0.5 * (in.positions[edge.v0] + in.positions[edge.v1]);
+        out.positions[vertex_count + face_count + e] = edge.faces == 2
+            ? 0.5 * mid + 0.25 * edge.face_sum
+            : mid;
+    }
+
+    parent.clear();
+    for (int f = 0; f < face_count; f++) {
+        int n = in.face_size(f);
+        int face_point = vertex_count + f;
+        for (int i = 0; i < n; i++) {
+            int next_edge = vertex_count + face_count + face_edges[in.face_start[f] + i];
+            int prev_edge = vertex_count + face_count + face_edges[in.face_start[f] + (i + n - 1) % n];
+            out.add_face({ in.vertex(f, i), next_edge, face_point, prev_edge });
+            parent.push_back(f);
+        }
+    }
+
+    return out;
+}
+
+// A Catmull-Clark surface tessellated lazily, one cage face (patch) at a time. A
+// patch is refined the first time a ray reaches its bounds, and the result is kept in
+// a geometry_cache, so detail costs memory only while rays are using it. The cache
+// can be shared between surfaces to put them under one budget.
+class subdivision_surface : public hittable {
+public:
+    subdivision_surface(
+        poly_mesh cage, shared_ptr<material> m, int subdivision_levels,
+        shared_ptr<geometry_cache> geometry);
+
+    // Triangles of patch f after the configured number of subdivision steps, from the
+    // cache when resident.
+    shared_ptr<triangle_mesh> tessellation(int f) const;
+
+    // The same, through the calling thread's pins, for traversal: patches a thread hit
+    // recently are found without locking the cache. Valid for as long as
+    // geometry_cache::get_pinned() says.
+    const triangle_mesh* pinned_tessellation(int f) const;
+
+    virtual bool hit(
+        const ray& r, double t_min, double t_max, hit_record& rec) const override {
+        return patches->hit(r, t_min, t_max, rec);
+    }
+
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+        return patches->bounding_box(time0, time1, output_box);
+    }
+
+public:
+    poly_mesh cage;
+    shared_ptr<material> mp;
+    int levels;
+    shared_ptr<geometry_cache> cache;
+    std::vector<std::vector<int>> vertex_faces;
+
+private:
+    shared_ptr<triangle_mesh> tessellate(int f) const;
+
+    shared_ptr<hittable> patches;
+};
+
+// A single cage face. Its bounds are those of the control points of the faces around
+// it, which contain the limit surface of the patch.
+class subdivision_patch : public hittable {
+public:
+    subdivision_patch(const subdivision_surface* s, int f, const aabb& b)
+        : surface(s), face(f), box(b) {}
+
+    virtual bool hit(
+        const ray& r, double t_min, double t_max, hit_record& rec) const override {
+        auto mesh = surface->pinned_tessellation(face);
+        if (!mesh->hit(r, t_min, t_max, rec))
+            return false;
+
+        // The pin may be dropped before the closest hit is known, so the surface
+        // interaction can't be deferred to a mesh that is no longer there.
+        rec.compute_surface_interaction(r);
+        return true;
+    }
+
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override {
+        output_box = box;
+        return true;
+    }
+
+public:
+    const subdivision_surface* surface;
+    int face;
+    aabb box;
+};
+
+subdivision_surface::subdivision_surface(
+    poly_mesh _cage, shared_ptr<material> m, int subdivision_levels,
+    shared_ptr<geometry_cache> geometry)
+    : cage(std::move(_cage)), mp(m), levels(subdivision_levels), cache(geometry)
+{
+    vertex_faces.resize(cage.positions.size());
+    for (int f = 0; f < cage.face_count(); f++)
+        for (int i = 0; i < cage.face_size(f); i++)
+            vertex_faces[cage.vertex(f, i)].push_back(f);
+
+    hittable_list list;
+    for (int f = 0; f < cage.face_count(); f++) {
+        point3 lo(infinity, infinity, infinity), hi(-infinity, -infinity, -infinity);
+        for (int i = 0; i < cage.face_size(f); i++) {
+            for (int g : vertex_faces[cage.vertex(f, i)]) {
+                for (int j = 0; j < cage.face_size(g); j++) {
+                    const auto& p = cage.positions[cage.vertex(g, j)];
+                    for (int a = 0; a < 3; a++) {
+                        lo[a] = fmin(lo[a], p[a]);
+                        hi[a] = fmax(hi[a], p[a]);
+                    }
+                }
+            }
+        }
+        for (int a = 0; a < 3; a++) {
+            lo[a] -= 0.0001;
+            hi[a] += 0.0001;
+        }
+        list.add(make_shared<subdivision_patch>(this, f, aabb(lo, hi)));
+    }
+    patches = make_shared<bvh_node>(list, 0, 1);
+}
+
+shared_ptr<triangle_mesh> subdivision_surface::tessellation(int f) const {
+    return std::static_pointer_cast<triangle_mesh>(cache->get(
+        geometry_cache::key{ this, static_cast<size_t>(f) },
+        [&](size_t& bytes) {
+            auto mesh = tessellate(f);
+            bytes = mesh->memory_size();
+            return std::static_pointer_cast<hittable>(mesh);
+        }));
+}
+
+const triangle_mesh* subdivision_surface::pinned_tessellation(int f) const {
+    return static_cast<const triangle_mesh*>(cache->get_pinned(
+        geometry_cache::key{ this, static_cast<size_t>(f) },
+        [&](size_t& bytes) {
+            auto mesh = tessellate(f);
+            bytes = mesh->memory_size();
+            return std::static_pointer_cast<hittable>(mesh);
+        }));
+}
+
+shared_ptr<triangle_mesh> subdivision_surface::tessellate(int f) const {
+    // Subdividing the one-ring of faces around f is enough to place every vertex of
+    // f's descendants exactly; the outer edge of the ring comes out wrong but is
+    // thrown away. Local face 0 is f itself.
+    poly_mesh local;
+    std::map<int, int> local_vertex;
+    std::vector<int> ring{ f };
+    for (int i = 0; i < cage.face_size(f); i++)
+        for (int g : vertex_faces[cage.vertex(f, i)])
+            if (std::find(ring.begin(), ring.end(), g) == ring.end())
+                ring.push_back(g);
+
+    for (int g : ring) {
+        for (int i = 0; i < cage.face_size(g); i++) {
+            int v = cage.vertex(g, i);
+            auto found = local_vertex.find(v);
+            if (found == local_vertex.end()) {
+                found = local_vertex.emplace(v, static_cast<int>(local.positions.size())).first;
+                local.positions.push_back(cage.positions[v]);
+            }
+            local.face_vertices.push_back(found->second);
+        }
+        local.face_start.push_back(static_cast<int>(local.face_vertices.size()));
+    }
+
+    // Track which ring face each refined face descends from.
+    std::vector<int> origin(local.face_count());
+    for (int i = 0; i < local.face_count(); i++)
+        origin[i] = i;
+
+    std::vector<int> parent;
+    for (int level = 0; level < levels; level++) {
+        local = catmull_clark(local, parent);
+        for (auto& p : parent)
+            p = origin[p];
+        origin.swap(parent);
+    }
+
+    // Vertex normals from every local face, so vertices on the patch border get the
+    // same normal from both patches that share them.
+    std::vector<vec3> normals(local.positions.size(), vec3(0, 0, 0));
+    for (int g = 0; g < local.face_count(); g++) {
+        int n = local.face_size(g);
+        vec3 face_normal(0, 0, 0);
+        for (int i = 0; i < n; i++) {
+            const auto& a = local.positions[local.vertex(g, i)];
+            const auto& b = local.positions[local.vertex(g, (i + 1) % n)];
+            face_normal += cross(a, b);
+        }
+        for (int i = 0; i < n; i++)
+            normals[local.vertex(g, i)] += face_normal;
+    }
+
+    std::vector<int> remap(local.positions.size(), -1);
+    std::vector<point3> positions;
+    std::vector<vec3> vertex_normals;
+    std::vector<int> indices;
+    auto use = [&](int v) {
+        if (remap[v] < 0) {
+            remap[v] = static_cast<int>(positions.size());
+            positions.push_back(local.positions[v]);
+            vertex_normals.push_back(unit_vector(normals[v]));
+        }
+        return remap[v];
+    };
+
+    for (int g = 0; g < local.face_count(); g++) {
+        if (origin[g] != 0)
+            continue;
+        int n = local.face_size(g);
+        for (int i = 1; i + 1 < n; i++) {
+            indices.push_back(use(local.vertex(g, 0)));
+            indices.push_back(use(local.vertex(g, i)));
+            indices.push_back(use(local.vertex(g, i + 1)));
+        }
+    }
+
+    auto mesh = make_shared<triangle_mesh>(
+        std::move(positions), std::move(indices), mp, std::move(vertex_normals));
+    mesh->compress();
+    return mesh;
+}
+
+#endif
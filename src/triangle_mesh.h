@@ -0,0 +1,482 @@
+#ifndef TRIANGLE_MESH_H
+#define TRIANGLE_MESH_H
+
+#include "rtweekend.h"
+
+#include "hittable.h"
+#include "packing.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <tuple>
+#include <vector>
+
+// An indexed triangle mesh with its own BVH. Triangles are reordered at construction
+// so every BVH leaf references a contiguous run of them. Per-vertex normals and uvs
+// are optional; without normals the geometric normal is used, without uvs the
+// barycentrics are.
+//
+// After compress() vertices are stored as 16-bit positions quantized to the mesh
+// bounds, octahedral normals and half-float uvs (14 bytes instead of 72). The BVH keeps
+// float bounds rounded outwards, so traversal never needs decoded data; positions are
+// decoded for the triangles a ray is tested against, normals and uvs only for the
+// closest hit.
+class triangle_mesh : public hittable {
+public:
+    static const int leaf_size = 4;
+
+    triangle_mesh() {}
+
+    triangle_mesh(
+        std::vector<point3> _positions, std::vector<int> _indices, shared_ptr<material> m,
+        std::vector<vec3> _normals = {}, std::vector<vec3> _uvs = {});
+
+    size_t triangle_count() const { return indices.size() / 3; }
+
+    // Mean edge length, the size of detail this mesh resolves.
+    double average_edge_length() const { return edge_length; }
+
+    // A coarser copy made by vertex clustering: vertices are merged per cell of a
+    // grid with the given cell size and collapsed triangles are dropped.
+    shared_ptr<triangle_mesh> decimated(double cell_size) const;
+
+    // Switches to the compressed vertex format and frees the full-precision arrays.
+    void compress();
+    bool is_compressed() const { return compressed; }
+
+    // Bytes held by the vertex, index and BVH arrays.
+    size_t memory_size() const {
+        return positions.capacity() * sizeof(point3) + normals.capacity() * sizeof(vec3)
+            + uvs.capacity() * sizeof(vec3) + indices.capacity() * sizeof(int)
+            + nodes.capacity() * sizeof(node) + qpositions.capacity() * sizeof(uint16_t)
+            + onormals.capacity() * sizeof(uint32_t) + huvs.capacity() * sizeof(uint16_t);
+    }
+
+    size_t vertex_count() const { return compressed ? qpositions.size() / 3 : positions.size(); }
+    bool has_normals() const { return compressed ? !onormals.empty() : !normals.empty(); }
+    bool has_uvs() const { return compressed ? !huvs.empty() : !uvs.empty(); }
+
+    point3 vertex_position(int i) const {
+        if (!compressed)
+            return positions[i];
+        return point3(
+            qmin.x() + qpositions[3 * i] * qscale.x(),
+            qmin.y() + qpositions[3 * i + 1] * qscale.y(),
+            qmin.z() + qpositions[3 * i + 2] * qscale.z());
+    }
+
+    vec3 vertex_normal(int i) const {
+        return compressed ? oct_decode(onormals[i]) : normals[i];
+    }
+
+    vec3 vertex_uv(int i) const {
+        if (!compressed)
+            return uvs[i];
+        return vec3(half_to_float(huvs[2 * i]), half_to_float(huvs[2 * i + 1]), 0);
+    }
+
+    virtual bool hit(
+        const ray& r, double t_min, double t_max, hit_record& rec) const override;
+    virtual void compute_surface_interaction(const ray& r, hit_record& rec) const override;
+    virtual bool bounding_box(double time0, double time1, aabb& output_box) const override;
+
+public:
+    struct node {
+        float bmin[3];
+        float bmax[3];
+        int offset;     // first triangle for leaves, right child for interior nodes
+        int count;      // number of triangles, zero for interior nodes
+        int axis;
+    };
+
+    std::vector<point3> positions;
+    std::vector<vec3> normals;
+    std::vector<vec3> uvs;
+    std::vector<int> indices;
+    shared_ptr<material> mp;
+    std::vector<node> nodes;
+    double edge_length = 0;
+
+    // Compressed vertex data, used instead of the arrays above once compressed is set.
+    bool compressed = false;
+    point3 qmin;
+    vec3 qscale;
+    std::vector<uint16_t> qpositions;
+    std::vector<uint32_t> onormals;
+    std::vector<uint16_t> huvs;
+
+private:
+    void build();
+    int build_recursive(std::vector<int>& order, std::vector<aabb>& boxes, size_t start, size_t end);
+    bool intersect_triangle(int tri, const ray& r, double t_min, double t_max,
+        double& t, double& b1, double& b2) const;
+};
+
+triangle_mesh::triangle_mesh(
+    std::vector<point3> _positions, std::vector<int> _indices, shared_ptr<material> m,
+    std::vector<vec3> _normals, std::vector<vec3> _uvs)
+    : positions(std::move(_positions)), normals(std::move(_normals)), uvs(std::move(_uvs)),
+    indices(std::move(_indices)), mp(m)
+{
+    build();
+}
+
+void triangle_mesh::build() {
+    size_t count = triangle_count();
+    nodes.clear();
+    if (count == 0)
+        return;
+
+    std::vector<int> order(count);
+    std::vector<aabb> boxes(count);
+    double edge_sum = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        order[i] = static_cast<int>(i);
+        const auto& p0 = positions[indices[3 * i]];
+        const auto& p1 = positions[indices[3 * i + 1]];
+        const auto& p2 = positions[indices[3 * i + 2]];
+        point3 lo, hi;
+        for (int a = 0; a < 3; a++) {
+            lo[a] = fmin(p0[a], fmin(p1[a], p2[a]));
+            hi[a] = fmax(p0[a], fmax(p1[a], p2[a]));
+        }
+        boxes[i] = aabb(lo, hi);
+        edge_sum += (p1 - p0).length() + (p2 - p1).length() + (p0 - p2).length();
+    }
+    edge_length = edge_sum / (3 * count);
+
+    nodes.reserve(2 * (count / leaf_size + 1));
+    build_recursive(order, boxes, 0, count);
+
+    auto old = indices;
+    for (size_t i = 0; i < count; i++)
+        for (int k = 0; k < 3; k++)
+            indices[3 * i + k] = old[3 * order[i] + k];
+}
+
+int triangle_mesh::build_recursive(
+    std::vector<int>& order, std::vector<aabb>& boxes, size_t start, size_t end
+) {
+    int index = static_cast<int>(nodes.size());
+    nodes.push_back(node());
+
+    aabb bounds = boxes[order[start]];
+    point3 cmin(infinity, infinity, infinity);
+    point3 cmax(-infinity, -infinity, -infinity);
+    for (size_t i = start; i < end; i++) {
+        const auto& b = boxes[order[i]];
+        bounds = surrounding_box(bounds, b);
+        for (int a = 0; a < 3; a++) {
+            auto c = 0.5 * (b.min()[a] + b.max()[a]);
+            cmin[a] = fmin(cmin[a], c);
+            cmax[a] = fmax(cmax[a], c);
+        }
+    }
+
+    // Pad flat boxes, as the rectangle primitives do, and round outwards to float so
+    // the stored bounds stay conservative.
+    point3 lo = bounds.min(), hi = bounds.max();
+    for (int a = 0; a < 3; a++) {
+        if (hi[a] - lo[a] < 0.0002) {
+            lo[a] -= 0.0001;
+            hi[a] += 0.0001;
+        }
+        nodes[index].bmin[a] = std::nextafterf(static_cast<float>(lo[a]), -HUGE_VALF);
+        nodes[index].bmax[a] = std::nextafterf(static_cast<float>(hi[a]), HUGE_VALF);
+    }
+
+    if (end - start <= leaf_size) {
+        nodes[index].offset = static_cast<int>(start);
+        nodes[index].count = static_cast<int>(end - start);
+        nodes[index].axis = 0;
+        return index;
+    }
+
+    int axis = 0;
+    for (int a = 1; a < 3; a++)
+        if (cmax[a] - cmin[a] > cmax[axis] - cmin[axis])
+            axis = a;
+
+    auto mid = start + (end - start) / 2;
+    std::nth_element(order.begin() + start, order.begin() + mid, order.begin() + end,
+        [&](int a, int b) {
+            return boxes[a].min()[axis] + boxes[a].max()[axis]
+                < boxes[b].min()[axis] + boxes[b].max()[axis];
+        });
+
+    build_recursive(order, boxes, start, mid);
+    int right = build_recursive(order, boxes, mid, end);
+
+    nodes[index].offset = right;
+    nodes[index].count = 0;
+    nodes[index].axis = axis;
+    return index;
+}
+
+bool triangle_mesh::intersect_triangle(
+    int tri, const ray& r, double t_min, double t_max, double& t, double& b1, double& b2
+) const {
+    // Moller-Trumbore.
+    auto p0 = vertex_position(indices[3 * tri]);
+    auto e1 = vertex_position(indices[3 * tri + 1]) - p0;
+    auto e2 = vertex_position(indices[3 * tri + 2]) - p0;
+
+    auto pvec = cross(r.direction(), e2);
+    auto det = dot(e1, pvec);
+    if (fabs(det) < 1e-12)
+        return false;
+    auto inv_det = 1 / det;
+
+    auto tvec = r.origin() - p0;
+    b1 = dot(tvec, pvec) * inv_det;
+    if (b1 < 0 || b1 > 1)
+        return false;
+
+    auto qvec = cross(tvec, e1);
+    b2 = dot(r.direction(), qvec) * inv_det;
+    if (b2 < 0 || b1 + b2 > 1)
+        return false;
+
+    t = dot(e2, qvec) * inv_det;
+    return t >= t_min && t <= t_max;
+}
+
+bool triangle_mesh::hit(const ray& r, double t_min, double t_max, hit_record& rec) const {
+    if (nodes.empty())
+        return false;
+
+    double inv_dir[3] = { 1 / r.direction().x(), 1 / r.direction().y(), 1 / r.direction().z() };
+    double closest = t_max;
+    int hit_tri = -1;
+    double hit_b1 = 0, hit_b2 = 0;
+
+    int stack[64];
+    int stack_size = 0;
+    stack[stack_size++] = 0;
+
+    while (stack_size > 0) {
+        int index = stack[--stack_size];
+        const node& n = nodes[index];
+
+        auto lo = t_min;
+        auto hi = closest;
+        bool miss = false;
+        for (int a = 0; a < 3 && !miss; a++) {
+            auto t0 = (n.bmin[a] - r.origin()[a]) * inv_dir[a];
+            auto t1 = (n.bmax[a] - r.origin()[a]) * inv_dir[a];
+            if (inv_dir[a] < 0)
+                std::swap(t0, t1);
+            lo = t0 > lo ? t0 : lo;
+            hi = t1 < hi ? t1 : hi;
+            miss = hi < lo;
+        }
+        if (miss)
+            continue;
+
+        if (n.count > 0) {
+            for (int i = n.offset; i < n.offset + n.count; i++) {
+                double t, b1, b2;
+                if (intersect_triangle(i, r, t_min, closest, t, b1, b2)) {
+                    closest = t;
+                    hit_tri = i;
+                    hit_b1 = b1;
+                    hit_b2 = b2;
+                }
+            }
+            continue;
+        }
+
+        // Push the far child first so the near child is visited first.
+        int near_child = index + 1;
+        int far_child = n.offset;
+        if (r.direction()[n.axis] < 0)
+            std::swap(near_child, far_child);
+        stack[stack_size++] = far_child;
+        stack[stack_size++] = near_child;
+    }
+
+    if (hit_tri < 0)
+        return false;
+
+    rec.set_deferred(this, closest, hit_tri);
+    rec.u = hit_b1;
+    rec.v = hit_b2;
+    return true;
+}
+
+void triangle_mesh::compute_surface_interaction(const ray& r, hit_record& rec) const {
+    int i0 = indices[3 * rec.prim_id];
+    int i1 = indices[3 * rec.prim_id + 1];
+    int i2 = indices[3 * rec.prim_id + 2];
+    auto b1 = rec.u;
+    auto b2 = rec.v;
+    auto b0 = 1 - b1 - b2;
+
+    rec.p = r.at(rec.t);
+
+    auto p0 = vertex_position(i0);
+    auto geometric_normal = unit_vector(cross(vertex_position(i1) - p0, vertex_position(i2) - p0));
+    if (!has_normals()) {
+        rec.set_face_normal(r, geometric_normal);
+    }
+    else {
+        // Shading normal, oriented with the geometric normal so front_face stays
+        // consistent with the winding.
+        auto n = unit_vector(b0 * vertex_normal(i0) + b1 * vertex_normal(i1) + b2 * vertex_normal(i2));
+        if (dot(n, geometric_normal) < 0)
+            n = -n;
+        rec.front_face = dot(r.direction(), geometric_normal) < 0;
+        rec.normal = rec.front_face ? n : -n;
+    }
+
+    if (has_uvs()) {
+        auto uv = b0 * vertex_uv(i0) + b1 * vertex_uv(i1) + b2 * vertex_uv(i2);
+        rec.u = uv.x();
+        rec.v = uv.y();
+    }
+
+    rec.mat_ptr = mp.get();
+}
+
+bool triangle_mesh::bounding_box(double time0, double time1, aabb& output_box) const {
+    if (nodes.empty())
+        return false;
+
+    const node& root = nodes[0];
+    output_box = aabb(
+        point3(root.bmin[0], root.bmin[1], root.bmin[2]),
+        point3(root.bmax[0], root.bmax[1], root.bmax[2]));
+    return true;
+}
+
+shared_ptr<triangle_mesh> triangle_mesh::decimated(double cell_size) const {
+    std::map<std::tuple<long long, long long, long long>, int> cells;
+    std::vector<int> remap(vertex_count());
+    std::vector<point3> new_positions;
+    std::vector<vec3> new_normals;
+    std::vector<vec3> new_uvs;
+    std::vector<int> weights;
+
+    for (int v = 0; v < static_cast<int>(vertex_count()); v++) {
+        auto p = vertex_position(v);
+        auto key = std::make_tuple(
+            static_cast<long long>(floor(p.x() / cell_size)),
+            static_cast<long long>(floor(p.y() / cell_size)),
+            static_cast<long long>(floor(p.z() / cell_size)));
+
+        auto it = cells.find(key);
+        if (it == cells.end()) {
+            it = cells.emplace(key, static_cast<int>(new_positions.size())).first;
+            new_positions.push_back(point3(0, 0, 0));
+            if (has_normals()) new_normals.push_back(vec3(0, 0, 0));
+            if (has_uvs()) new_uvs.push_back(vec3(0, 0, 0));
+            weights.push_back(0);
+        }
+
+        int c = it->second;
+        remap[v] = c;
+        new_positions[c] += p;
+        if (has_normals()) new_normals[c] += vertex_normal(v);
+        if (has_uvs()) new_uvs[c] += vertex_uv(v);
+        weights[c]++;
+    }
+
+    for (size_t c = 0; c < new_positions.size(); c++) {
+        new_positions[c] /= weights[c];
+        if (!new_normals.empty()) new_normals[c] = unit_vector(new_normals[c]);
+        if (!new_uvs.empty()) new_uvs[c] /= weights[c];
+    }
+
+    std::vector<int> new_indices;
+    for (size_t i = 0; i < indices.size(); i += 3) {
+        int a = remap[indices[i]], b = remap[indices[i + 1]], c = remap[indices[i + 2]];
+        if (a == b || b == c || c == a)
+            continue;
+        new_indices.push_back(a);
+        new_indices.push_back(b);
+        new_indices.push_back(c);
+    }
+
+    auto mesh = make_shared<triangle_mesh>(
+        std::move(new_positions), std::move(new_indices), mp, std::move(new_normals), std::move(new_uvs));
+    if (compressed)
+        mesh->compress();
+    return mesh;
+}
+
+void triangle_mesh::compress() {
+    if (compressed || positions.empty())
+        return;
+
+    qmin = positions[0];
+    point3 qmax = positions[0];
+    for (const auto& p : positions) {
+        for (int a = 0; a < 3; a++) {
+            qmin[a] = fmin(qmin[a], p[a]);
+            qmax[a] = fmax(qmax[a], p[a]);
+        }
+    }
+    for (int a = 0; a < 3; a++)
+        qscale[a] = (qmax[a] - qmin[a]) / 65535;
+
+    qpositions.resize(3 * positions.size());
+    for (size_t i = 0; i < positions.size(); i++) {
+        for (int a = 0; a < 3; a++) {
+            auto q = qscale[a] > 0 ? (positions[i][a] - qmin[a]) / qscale[a] : 0.0;
+            qpositions[3 * i + a] = static_cast<uint16_t>(clamp(floor(q + 0.5), 0.0, 65535.0));
+        }
+    }
+
+    onormals.resize(normals.size());
+    for (size_t i = 0; i < normals.size(); i++)
+        onormals[i] = oct_encode(unit_vector(normals[i]));
+
+    huvs.resize(2 * uvs.size());
+    for (size_t i = 0; i < uvs.size(); i++) {
+        huvs[2 * i] = float_to_half(static_cast<float>(uvs[i].x()));
+        huvs[2 * i + 1] = float_to_half(static_cast<float>(uvs[i].y()));
+    }
+
+    compressed = true;
+    std::vector<point3>().swap(positions);
+    std::vector<vec3>().swap(normals);
+    std::vector<vec3>().swap(uvs);
+
+    // Quantization moves vertices by up to half a step, so refit the BVH bounds to
+    // the decoded positions.
+    for (int i = static_cast<int>(nodes.size()) - 1; i >= 0; i--) {
+        auto& n = nodes[i];
+        point3 lo(infinity, infinity, infinity), hi(-infinity, -infinity, -infinity);
+        if (n.count > 0) {
+            for (int t = n.offset; t < n.offset + n.count; t++) {
+                for (int k = 0; k < 3; k++) {
+                    auto p = vertex_position(indices[3 * t + k]);
+                    for (int a = 0; a < 3; a++) {
+                        lo[a] = fmin(lo[a], p[a]);
+                        hi[a] = fmax(hi[a], p[a]);
+                    }
+                }
+            }
+        }
+        else {
+            for (const node* child : { &nodes[i + 1], &nodes[n.offset] }) {
+                for (int a = 0; a < 3; a++) {
+                    lo[a] = fmin(lo[a], child->bmin[a]);
+                    hi[a] = fmax(hi[a], child->bmax[a]);
+                }
+            }
+        }
+        for (int a = 0; a < 3; a++) {
+            if (n.count > 0 && hi[a] - lo[a] < 0.0002) {
+                lo[a] -= 0.0001;
+                hi[a] += 0.0001;
+            }
+            n.bmin[a] = std::nextafterf(static_cast<float>(lo[a]), -HUGE_VALF);
+            n.bmax[a] = std::nextafterf(static_cast<float>(hi[a]), HUGE_VALF);
+        }
+    }
+}
+
+#endif
@@ -113,12 +113,25 @@ inline vec3 unit_vector(vec3 v) {
     return v / v.length();
 }
 
+// The samplers below map uniform numbers in [0,1) to their domain in closed form, so
+// each takes a fixed count of random numbers and can be fed stratified or
+// low-discrepancy samples instead of random_double().
+
+inline vec3 random_unit_vector(double u1, double u2) {
+    auto z = 1 - 2 * u1;
+    auto r = sqrt(fmax(0.0, 1 - z * z));
+    auto phi = 2 * pi * u2;
+    return vec3(r * cos(phi), r * sin(phi), z);
+}
+
+inline vec3 random_in_unit_sphere(double u1, double u2, double u3) {
+    return cbrt(u3) * random_unit_vector(u1, u2);
+}
+
 vec3 random_in_unit_sphere() {
-    while (true) {
-        auto p = vec3::random(-1, 1);
-        if (p.length_squared() >= 1) continue;
-        return p;
-    }
+    double u1, u2;
+    random_double2(u1, u2);
+    return random_in_unit_sphere(u1, u2, random_double());
 }
 
 vec3 random_in_hemisphere(const vec3& normal) {
@@ -130,16 +143,16 @@ vec3 random_in_hemisphere(const vec3& normal) {
 }
 
 vec3 random_unit_vector() {
-    return unit_vector(random_in_unit_sphere());
+    double u1, u2;
+    random_double2(u1, u2);
+    return random_unit_vector(u1, u2);
 }
 
 vec3 reflect(const vec3& v, const vec3& n) {
     return v - 2 * dot(v, n) * n;
 }
 
-inline vec3 random_cosine_direction() {
-    auto r1 = random_double();
-    auto r2 = random_double();
+inline vec3 random_cosine_direction(double r1, double r2) {
     auto z = sqrt(1 - r2);
 
     auto phi = 2 * pi * r1;
@@ -149,6 +162,12 @@ inline vec3 random_cosine_direction() {
     return vec3(x, y, z);
 }
 
+inline vec3 random_cosine_direction() {
+    double r1, r2;
+    random_double2(r1, r2);
+    return random_cosine_direction(r1, r2);
+}
+
 vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat) {
     auto cos_theta = fmin(dot(uv, -n), 1.0);
     vec3 r_out_perp = etai_over_etat * (uv + cos_theta * n);
@@ -156,17 +175,27 @@ vec3 refract(const vec3& uv, const vec3& n, double etai_over_etat) {
     return r_out_perp + r_out_parallel;
 }
 
+inline vec3 random_in_unit_disk(double u1, double u2) {
+    // Concentric mapping of the square onto the disk (Shirley and Chiu), which keeps
+    // strata of the input compact on the disk.
+    auto a = 2 * u1 - 1;
+    auto b = 2 * u2 - 1;
+    if (a == 0 && b == 0)
+        return vec3(0, 0, 0);
+
+    bool outer_x = a * a > b * b;
+    auto r = outer_x ? a : b;
+    auto phi = outer_x ? (pi / 4) * (b / a) : (pi / 2) - (pi / 4) * (a / b);
+    return vec3(r * cos(phi), r * sin(phi), 0);
+}
+
 vec3 random_in_unit_disk() {
-    while (true) {
-        auto p = vec3(random_double(-1, 1), random_double(-1, 1), 0);
-        if (p.length_squared() >= 1) continue;
-        return p;
-    }
+    double u1, u2;
+    random_double2(u1, u2);
+    return random_in_unit_disk(u1, u2);
 }
 
-inline vec3 random_to_sphere(double radius, double distance_squared) {
-    auto r1 = random_double();
-    auto r2 = random_double();
+inline vec3 random_to_sphere(double radius, double distance_squared, double r1, double r2) {
     auto z = 1 + r2 * (sqrt(1 - radius * radius / distance_squared) - 1);
 
     auto phi = 2 * pi * r1;
@@ -176,4 +205,10 @@ inline vec3 random_to_sphere(double radius, double distance_squared) {
     return vec3(x, y, z);
 }
 
+inline vec3 random_to_sphere(double radius, double distance_squared) {
+    double r1, r2;
+    random_double2(r1, r2);
+    return random_to_sphere(radius, distance_squared, r1, r2);
+}
+
 #endif
\ No newline at end of file
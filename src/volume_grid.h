@@ -0,0 +1,202 @@
+#ifndef VOLUME_GRID_H
+#define VOLUME_GRID_H
+
+#include "rtweekend.h"
+#include "aabb.h"
+
+#include <algorithm>
+#include <vector>
+
+// A scalar density field sampled on a voxel grid.
+class volume_grid {
+public:
+    virtual ~volume_grid() {}
+
+    // Lookup state a caller keeps across coherent queries, such as the steps along one
+    // ray. Tree-structured grids remember the last leaf they descended to in it.
+    struct cache {
+        const void* leaf = nullptr;
+        int origin[3] = { 0, 0, 0 };
+        bool valid = false;
+    };
+
+    // Trilinearly filtered density at a world-space point; zero outside bounds().
+    virtual double density(const point3& p) const = 0;
+
+    virtual double cached_density(const point3& p, cache& c) const {
+        return density(p);
+    }
+
+    // An upper bound of density() over a world-space region.
+    virtual double max_density(const aabb& region) const = 0;
+
+    virtual aabb bounds() const = 0;
+};
+
+// Every voxel stored in one nx * ny * nz array, x varying fastest.
+class dense_grid : public volume_grid {
+public:
+    dense_grid(int _nx, int _ny, int _nz, const aabb& _box, std::vector<float> voxels)
+        : nx(_nx), ny(_ny), nz(_nz), box(_box), data(std::move(voxels))
+    {
+        auto extent = box.max() - box.min();
+        voxel_size = vec3(extent.x() / nx, extent.y() / ny, extent.z() / nz);
+    }
+
+    virtual double density(const point3& p) const override;
+    virtual double max_density(const aabb& region) const override;
+
+    virtual aabb bounds() const override {
+        return box;
+    }
+
+    float voxel(int x, int y, int z) const {
+        if (x < 0 || y < 0 || z < 0 || x >= nx || y >= ny || z >= nz)
+            return 0;
+        return data[(static_cast<size_t>(z) * ny + y) * nx + x];
+    }
+
+public:
+    int nx, ny, nz;
+    aabb box;
+    vec3 voxel_size;
+    std::vector<float> data;
+};
+
+double dense_grid::density(const point3& p) const {
+    // Continuous voxel coordinates, with voxel centers at integer + 0.5.
+    auto gx = (p.x() - box.min().x()) / voxel_size.x() - 0.5;
+    auto gy = (p.y() - box.min().y()) / voxel_size.y() - 0.5;
+    auto gz = (p.z() - box.min().z()) / voxel_size.z() - 0.5;
+
+    auto x0 = static_cast<int>(floor(gx));
+    auto y0 = static_cast<int>(floor(gy));
+    auto z0 = static_cast<int>(floor(gz));
+    auto fx = gx - x0;
+    auto fy = gy - y0;
+    auto fz = gz - z0;
+
+    auto accum = 0.0;
+    for (int k = 0; k < 2; k++)
+        for (int j = 0; j < 2; j++)
+            for (int i = 0; i < 2; i++)
+                accum += (i * fx + (1 - i) * (1 - fx))
+                    * (j * fy + (1 - j) * (1 - fy))
+                    * (k * fz + (1 - k) * (1 - fz))
+                    * voxel(x0 + i, y0 + j, z0 + k);
+
+    return accum;
+}
+
+double dense_grid::max_density(const aabb& region) const {
+    // Trilinear filtering reaches one voxel beyond the region on each side.
+    auto lo = region.min() - box.min();
+    auto hi = region.max() - box.min();
+    int x0 = std::max(0, static_cast<int>(floor(lo.x() / voxel_size.x())) - 1);
+    int y0 = std::max(0, static_cast<int>(floor(lo.y() / voxel_size.y())) - 1);
+    int z0 = std::max(0, static_cast<int>(floor(lo.z() / voxel_size.z())) - 1);
+    int x1 = std::min(nx - 1, static_cast<int>(floor(hi.x() / voxel_size.x())) + 1);
+    int y1 = std::min(ny - 1, static_cast<int>(floor(hi.y() / voxel_size.y())) + 1);
+    int z1 = std::min(nz - 1, static_cast<int>(floor(hi.z() / voxel_size.z())) + 1);
+
+    float result = 0;
+    for (int z = z0; z <= z1; z++)
+        for (int y = y0; y <= y1; y++)
+            for (int x = x0; x <= x1; x++)
+                result = std::max(result, voxel(x, y, z));
+
+    return result;
+}
+
+// A coarse grid of density upper bounds over a volume_grid. Tracking steps through it
+// cell by cell, so sparse or thin regions of the volume are crossed with a tight
+// majorant instead of the global maximum.
+class majorant_grid {
+public:
+    majorant_grid() {}
+
+    majorant_grid(const volume_grid& grid, int resolution, double scale = 1.0)
+        : res(resolution), box(grid.bounds()), values(static_cast<size_t>(res) * res * res)
+    {
+        auto extent = box.max() - box.min();
+        cell_size = extent / res;
+
+        for (int z = 0; z < res; z++) {
+            for (int y = 0; y < res; y++) {
+                for (int x = 0; x < res; x++) {
+                    auto lo = box.min() + vec3(x * cell_size.x(), y * cell_size.y(), z * cell_size.z());
+                    values[(static_cast<size_t>(z) * res + y) * res + x] =
+                        scale * grid.max_density(aabb(lo, lo + cell_size));
+                }
+            }
+        }
+    }
+
+    // Steps through the cells the ray crosses between t_min and t_max, in order, and
+    // calls f(t0, t1, majorant) for each. Stops early when f returns true.
+    template <typename F>
+    bool traverse(const ray& r, double t_min, double t_max, F f) const;
+
+public:
+    int res = 0;
+    aabb box;
+    vec3 cell_size;
+    std::vector<double> values;
+};
+
+template <typename F>
+bool majorant_grid::traverse(const ray& r, double t_min, double t_max, F f) const {
+    if (!box.clip(r, t_min, t_max))
+        return false;
+
+    auto p = r.at(t_min) - box.min();
+    int cell[3], step[3], limit[3];
+    double next_t[3], delta_t[3];
+
+    for (int a = 0; a < 3; a++) {
+        cell[a] = static_cast<int>(floor(p[a] / cell_size[a]));
+        cell[a] = cell[a] < 0 ? 0 : cell[a] >= res ? res - 1 : cell[a];
+
+        auto d = r.direction()[a];
+        if (d > 0) {
+            step[a] = 1;
+            limit[a] = res;
+            next_t[a] = t_min + ((cell[a] + 1) * cell_size[a] - p[a]) / d;
+            delta_t[a] = cell_size[a] / d;
+        }
+        else if (d < 0) {
+            step[a] = -1;
+            limit[a] = -1;
+            next_t[a] = t_min + (cell[a] * cell_size[a] - p[a]) / d;
+            delta_t[a] = -cell_size[a] / d;
+        }
+        else {
+            step[a] = 0;
+            limit[a] = -1;
+            next_t[a] = infinity;
+            delta_t[a] = infinity;
+        }
+    }
+
+    auto t = t_min;
+    while (t < t_max) {
+        int axis = (next_t[0] < next_t[1])
+            ? (next_t[0] < next_t[2] ? 0 : 2)
+            : (next_t[1] < next_t[2] ? 1 : 2);
+        auto t_exit = std::min(next_t[axis], t_max);
+
+        auto majorant = values[(static_cast<size_t>(cell[2]) * res + cell[1]) * res + cell[0]];
+        if (f(t, t_exit, majorant))
+            return true;
+
+        t = t_exit;
+        cell[axis] += step[axis];
+        if (cell[axis] == limit[axis])
+            break;
+        next_t[axis] += delta_t[axis];
+    }
+
+    return false;
+}
+
+#endif
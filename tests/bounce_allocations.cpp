@@ -0,0 +1,104 @@
+// Checks that tracing paths does no heap allocation once the scene is built: every
+// operator new is counted, and the bounce loop of ray_color must leave the count alone.
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#define GLFW_INCLUDE_NONE
+#include "GLFW/glfw3.h"
+
+#include "raytracer.h"
+
+static std::atomic<long long> allocations(0);
+
+void* operator new(std::size_t size)
+{
+	allocations++;
+	if (void* p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void* p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+int main()
+{
+	// The Cornell box of raytracer::init_cornell_box, with a fog box added so shadow
+	// rays go through a medium too.
+	auto red = make_shared<lambertian>(color(.65, .05, .05));
+	auto white = make_shared<lambertian>(color(.73, .73, .73));
+	auto green = make_shared<lambertian>(color(.12, .45, .15));
+	auto light = make_shared<diffuse_light>(color(15, 15, 15));
+
+	hittable_list world;
+	world.add(make_shared<yz_rect>(0, 555, 0, 555, 555, green));
+	world.add(make_shared<yz_rect>(0, 555, 0, 555, 0, red));
+	world.add(make_shared<flip_face>(make_shared<xz_rect>(213, 343, 227, 332, 554, light)));
+	world.add(make_shared<xz_rect>(0, 555, 0, 555, 0, white));
+	world.add(make_shared<xz_rect>(0, 555, 0, 555, 555, white));
+	world.add(make_shared<xy_rect>(0, 555, 0, 555, 555, white));
+
+	shared_ptr<hittable> box1 = make_shared<box>(point3(0, 0, 0), point3(165, 330, 165), white);
+	box1 = make_shared<rotate_y>(box1, 15);
+	box1 = make_shared<translate>(box1, vec3(265, 0, 295));
+	world.add(box1);
+
+	world.add(make_shared<sphere>(point3(190, 90, 190), 90, make_shared<dielectric>(1.5)));
+
+	shared_ptr<hittable> fog = make_shared<box>(point3(0, 0, 0), point3(555, 100, 555), white);
+	world.add(make_shared<constant_medium>(fog, 0.001, color(1, 1, 1)));
+
+	auto lights = build_light_bvh(world);
+
+	camera cam;
+	cam.init(lookfrom, lookat, vup, vfov, 1, aperture, dist_to_focus, 0.0, 1.0, 64);
+	sobol_sampler samples;
+	sampler_scope scope(&samples);
+
+	auto trace = [&](int count) {
+		color sum(0, 0, 0);
+		for (int s = 0; s < count; s++) {
+			int i = s % 64, j = (s / 64) % 64;
+			samples.start_pixel_sample(i, j, s / 4096);
+			double du, dv;
+			random_double2(du, dv);
+			ray r = cam.get_ray((i + du) / 63, (j + dv) / 63);
+			sum += ray_color(r, color(0, 0, 0), world, *lights, max_depth);
+		}
+		return sum;
+	};
+
+	// Anything set up lazily on first use, such as thread-local state, happens here.
+	trace(64);
+
+	long long before = allocations;
+	auto sum = trace(64 * 64 * 4);
+	long long during = allocations - before;
+
+	std::printf("%lld allocations over %d paths (mean red %g)\n", during, 64 * 64 * 4, sum.x() / (64 * 64 * 4));
+	return during == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
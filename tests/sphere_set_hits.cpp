@@ -0,0 +1,53 @@
+// Checks that a sphere_set finds the same hits as the same spheres built as sphere
+// objects under a bvh_node, for rays from inside the cloud and from far outside it,
+// where the single-precision prefilter of the AVX2 path has the least slack.
+#include <cstdio>
+#include <cstdlib>
+
+#define GLFW_INCLUDE_NONE
+#include "GLFW/glfw3.h"
+
+#include "raytracer.h"
+
+int main()
+{
+	auto white = make_shared<lambertian>(color(.73, .73, .73));
+	auto red = make_shared<lambertian>(color(.65, .05, .05));
+
+	sphere_set set;
+	int materials[2] = { set.add_material(white), set.add_material(red) };
+	hittable_list list;
+
+	for (int i = 0; i < 20000; i++) {
+		auto center = vec3::random(-100, 100);
+		auto radius = random_double(0.05, 1.0);
+		int m = i % 2;
+		set.add(center, radius, materials[m]);
+		// The set keeps its spheres in single precision.
+		list.add(make_shared<sphere>(
+			point3(float(center.x()), float(center.y()), float(center.z())), float(radius), m ? red : white));
+	}
+	set.build();
+	bvh_node reference(list, 0, 1);
+
+	int rays = 0, hits = 0, mismatches = 0;
+	auto check = [&](const ray& r) {
+		hit_record a, b;
+		bool hit_a = set.hit(r, 0.001, infinity, a);
+		bool hit_b = reference.hit(r, 0.001, infinity, b);
+		rays++;
+		hits += hit_a;
+		if (hit_a != hit_b || (hit_a && (fabs(a.t - b.t) > 1e-6 * fmax(1.0, b.t) || a.mat_ptr != b.mat_ptr)))
+			mismatches++;
+	};
+
+	for (int i = 0; i < 20000; i++)
+		check(ray(vec3::random(-120, 120), vec3::random(-1, 1)));
+	for (int i = 0; i < 20000; i++) {
+		auto origin = 800 * unit_vector(vec3::random(-1, 1));
+		check(ray(origin, vec3::random(-100, 100) - origin));
+	}
+
+	std::printf("%d mismatches over %d rays (%d hits)\n", mismatches, rays, hits);
+	return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}